@@ -10,8 +10,22 @@ input image, the program will create a new P6 image as output that has the edges
 #include <stdlib.h>
 #include <math.h>
 #include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 #include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "shm_ring.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define LAPLACIAN_THREADS 23     //change the number of threads as you run your concurrency experiment
 
@@ -21,100 +35,466 @@ input image, the program will create a new P6 image as output that has the edges
 
 #define RGB_COMPONENT_COLOR 255
 
+#define MAX_OUTPUTS 16           //maximum number of -o outputs written per input image
+#define DEFAULT_THRESHOLD 32     //laplacian strength at which the threshold mask turns on
+#define FLAT_TILE 16             //side of the tiles the fused pass checks for uniformity
+#define SHARPEN_SHIFT 8          //sharpening strength is fixed point with this many fraction bits
+
 typedef struct {
       unsigned char r, g, b;
 } PPMPixel;
 
+/* Operators that the fused pass can evaluate on each 3x3 window. */
+enum edge_operator {
+    OP_LAPLACIAN,   //per channel laplacian, 3 channels
+    OP_SOBEL,       //per channel sobel gradient magnitude, 3 channels
+    OP_THRESHOLD,   //255 where the strongest laplacian channel reaches the threshold, 1 channel
+    OP_DIZENZO,     //colour gradient magnitude from the structure tensor of all channels, 1 channel
+    OP_DISTANCE,    //euclidean distance to the nearest pixel of the threshold mask, 1 channel, float
+    OP_THIN,        //threshold mask thinned to one pixel wide lines, 1 channel
+    OP_SHARPEN,     //original plus alpha times the unclamped laplacian, 3 channels
+    OP_COUNT
+};
+
+enum output_format {
+    FORMAT_PPM,     //P6, single channel results are replicated into r, g and b
+    FORMAT_PGM,     //P5, three channel results are reduced to their strongest channel; 16-bit for distances
+    FORMAT_PFM,     //Pf, float results only
+    FORMAT_RLE,     //run-length encoded, masks only
+    FORMAT_COUNT
+};
+
+const char *operator_names[OP_COUNT] = { "laplacian", "sobel", "threshold", "dizenzo", "distance", "thin", "sharpen" };
+const char *format_names[FORMAT_COUNT] = { "ppm", "pgm", "pfm", "rle" };
+
+/* One requested output: which operator and which file format to write it in. */
+struct output_spec {
+    enum edge_operator op;
+    enum output_format format;
+};
+
+/* A growable list of ints. */
+struct int_list {
+    int32_t *items;
+    unsigned long int count;
+    unsigned long int capacity;
+};
+
+/* Result buffers of one fused pass. Operators that were not requested are NULL and skipped by the workers. */
+struct filter_outputs {
+    PPMPixel *laplacian;     //laplacian filtered pixel data
+    PPMPixel *sobel;         //sobel gradient magnitude pixel data
+    unsigned char *mask;     //threshold mask, one byte per pixel
+    unsigned char *dizenzo;  //Di Zenzo colour gradient magnitude, one byte per pixel
+    unsigned char *thin;     //thinned threshold mask, filled after the pass from mask
+    float *magnitude;        //gradient magnitude of the strongest channel, for the HOG stage
+    float *orientation;      //its unsigned orientation in degrees, 0 to 180
+    float *tensor;           //Sobel gradient products summed over r, g and b, xx, yy and xy per pixel, for the corner stage
+    PPMPixel *sharpen;       //sharpened pixel data
+    struct int_list *mask_runs; //run lengths of mask, alternately off and on, when it is written as rle
+    unsigned long int *heatmap;  //edge pixels per heatmap cell, heatmap_rows x heatmap_columns, summed from the threads
+    const int *heat_column;      //heatmap column of every image column
+    int heatmap_columns;
+    int heatmap_rows;
+    int threshold;           //laplacian strength at which the mask turns on
+    int sharpen_alpha;       //sharpening strength, fixed point with SHARPEN_SHIFT fraction bits
+    unsigned long int tiles;      //stats: tiles visited by the pass
+    unsigned long int flat_tiles; //stats: tiles skipped because they were uniform
+};
+
 struct parameter {
     PPMPixel *image;         //original image pixel data
-    PPMPixel *result;        //filtered image pixel data
+    const PPMPixel *previous; //motion mode: the frame before image, laid out the same way; NULL otherwise
+    unsigned long int stride; //bytes from one row of image to the next, at least 3 * w
+    struct filter_outputs *out; //filtered image pixel data for every requested operator
     unsigned long int w;     //width of image
     unsigned long int h;     //height of image
     unsigned long int start; //starting point of work
     unsigned long int size;  //equal share of work (almost equal if odd)
+    unsigned long int tiles;      //tiles this thread visited
+    unsigned long int flat_tiles; //tiles this thread found uniform and skipped
+    struct int_list runs;    //run lengths of this region of the mask
+    unsigned long int *heat; //this thread's partial heatmap
 };
 
 
 struct file_name_args {
     char *input_file_name;      //e.g., file1.ppm
-    char output_file_name[20];  //will take the form laplaciani.ppm, e.g., laplacian1.ppm
+    char *previous_file_name;   //motion mode: the frame before input_file_name
+    int index;                  //image file order in the passed arguments, outputs take the form <operator>i.<format>, e.g., laplacian1.ppm
 };
 
 double total_elapsed_time = 0;
 
+struct output_spec output_specs[MAX_OUTPUTS] = { { OP_LAPLACIAN, FORMAT_PPM } };
+int output_count = 1;
+int threshold_value = DEFAULT_THRESHOLD;
+int sharpen_alpha = 1 << SHARPEN_SHIFT;
+int flat_skip_enabled = 1;
+int stats_enabled = 0;
+int motion_enabled = 0;          //inputs are consecutive frames, every output comes from the difference of two
+
 pthread_mutex_t mutex_a = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mutex_b = PTHREAD_MUTEX_INITIALIZER; 
 pthread_mutex_t mutex_c = PTHREAD_MUTEX_INITIALIZER;
 
-/*This is the thread function. It will compute the new values for the region of image specified in params (start to start+size) using convolution.
+void int_list_push(struct int_list *list, int32_t value)
+{
+    if(list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? 2 * list->capacity : 256;
+        list->items = realloc(list->items, list->capacity * sizeof(int32_t));
+    }
+    list->items[list->count++] = value;
+}
+
+/* Append the run lengths of mask[0..n) to runs, alternately off and on, starting with a possibly empty off run.
+ Mask bytes are 0 or 255, so runs are skipped eight bytes at a time.
+ */
+void run_length_encode(const unsigned char *mask, unsigned long int n, struct int_list *runs)
+{
+    unsigned long int i = 0;
+    uint64_t word, pattern = 0;
+    while(i < n)
+    {
+        unsigned long int j = i;
+        while(j + 8 <= n)
+        {
+            memcpy(&word, mask + j, 8);
+            if(word != pattern) break;
+            j += 8;
+        }
+        while(j < n && mask[j] == (unsigned char)pattern) j++;
+        int_list_push(runs, j - i);
+        i = j;
+        pattern = ~pattern;
+    }
+}
+
+/* Append the runs of one band to those of the bands above it. Only the runs meeting at the boundary are looked at:
+ an empty leading run is dropped, and a run continuing the last one is added to it.
+ */
+void append_runs(struct int_list *runs, const struct int_list *band)
+{
+    for(unsigned long int k = 0; k < band->count; k++)
+    {
+        if(band->items[k] == 0 && runs->count > 0) continue;
+        if(k % 2 != runs->count % 2) runs->items[runs->count - 1] += band->items[k];
+        else int_list_push(runs, band->items[k]);
+    }
+}
+
+unsigned char clamp_pixel(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+unsigned char sobel_magnitude(int gx, int gy)
+{
+    int m = (int)(sqrtf((float)(gx * gx + gy * gy)) + 0.5f);
+    return m > 255 ? 255 : m;
+}
+
+/* Di Zenzo colour gradient: the square root of the largest eigenvalue of the structure tensor summed over r, g and b,
+ i.e. the rate of change of the colour along the direction where it changes most. Edges between colours of equal
+ luminance, where the channel gradients cancel out in grey, still show up. The eigenvalue is divided by the number of
+ channels so a grey image gives the same value as its Sobel magnitude.
+ */
+unsigned char dizenzo_magnitude(const int *gx, const int *gy)
+{
+    double gxx = 0, gyy = 0, gxy = 0;
+    for(int c = 0; c < 3; c++)
+    {
+        gxx += (double)gx[c] * gx[c];
+        gyy += (double)gy[c] * gy[c];
+        gxy += (double)gx[c] * gy[c];
+    }
+    double lambda = (gxx + gyy + sqrt((gxx - gyy) * (gxx - gyy) + 4 * gxy * gxy)) / 2;
+    int m = (int)(sqrt(lambda / 3) + 0.5);
+    return m > 255 ? 255 : m;
+}
+
+const int laplacian[FILTER_HEIGHT][FILTER_WIDTH] =
+{
+    {-1, -1, -1},
+    {-1,  8, -1},
+    {-1, -1, -1}
+};
+
+/* Evaluate every operator requested in out on the 3x3 window centred on column x of rows[1], and store the results at index.
+ With previous_rows (motion mode) the window holds |rows - previous_rows| instead, the frame difference taken as it is loaded.
+ Return: the strongest channel of the clamped Laplacian, which the heatmap counts, or 0 when nothing needs it
     For each pixel in the input image, the filter is conceptually placed on top of the image with its origin lying on that pixel.
     The  values  of  each  input  image  pixel  under  the  mask  are  multiplied  by the corresponding filter values.
     Truncate values smaller than zero to zero and larger than 255 to 255.
     The results are summed together to yield a single output value that is placed in the output image at the location of the pixel being processed on the input.
- 
  */
-void *compute_laplacian_threadfn(void *params)
+int filter_pixel(struct filter_outputs *out, const PPMPixel *const *rows, const PPMPixel *const *previous_rows, unsigned long int w, unsigned long int x, unsigned long int index)
 {
-    int laplacian[FILTER_WIDTH][FILTER_HEIGHT] =
+    int window[3][FILTER_HEIGHT][FILTER_WIDTH];   //channel, row, column
+    int strongest = 0;
+
+    //Loading the window once, every operator below reads from it.
+    for(int iteratorFilterWidth = 0; iteratorFilterWidth < FILTER_WIDTH; iteratorFilterWidth++)
     {
-        {-1, -1, -1},
-        {-1,  8, -1},
-        {-1, -1, -1}
-    };
+        unsigned long int x_coordinate = ( x - FILTER_WIDTH / 2 + iteratorFilterWidth + w ) % w;
+        for(int iteratorFilterHeight = 0; iteratorFilterHeight < FILTER_HEIGHT; iteratorFilterHeight++)
+        {
+            const PPMPixel *pixel = &rows[iteratorFilterHeight][x_coordinate];
+            window[0][iteratorFilterHeight][iteratorFilterWidth] = pixel->r;
+            window[1][iteratorFilterHeight][iteratorFilterWidth] = pixel->g;
+            window[2][iteratorFilterHeight][iteratorFilterWidth] = pixel->b;
+            if(previous_rows)
+            {
+                const PPMPixel *before = &previous_rows[iteratorFilterHeight][x_coordinate];
+                window[0][iteratorFilterHeight][iteratorFilterWidth] = abs(pixel->r - before->r);
+                window[1][iteratorFilterHeight][iteratorFilterWidth] = abs(pixel->g - before->g);
+                window[2][iteratorFilterHeight][iteratorFilterWidth] = abs(pixel->b - before->b);
+            }
+        }
+    }
+
+    if(out->laplacian || out->mask || out->sharpen || out->heatmap)
+    {
+        int lap[3], sharp[3];
+        for(int c = 0; c < 3; c++)
+        {
+            int sum = 0;
+            for(int iteratorFilterHeight = 0; iteratorFilterHeight < FILTER_HEIGHT; iteratorFilterHeight++)
+            {
+                for(int iteratorFilterWidth = 0; iteratorFilterWidth < FILTER_WIDTH; iteratorFilterWidth++)
+                {
+                    sum += window[c][iteratorFilterHeight][iteratorFilterWidth] * laplacian[iteratorFilterHeight][iteratorFilterWidth];
+                }
+            }
+            //Sharpening adds the signed response, rounded to nearest (the shift is arithmetic, so it floors).
+            sharp[c] = clamp_pixel(window[c][1][1] + ((out->sharpen_alpha * sum + (1 << (SHARPEN_SHIFT - 1))) >> SHARPEN_SHIFT));
+            //Truncate values smaller than zero to zero and larger than 255 to 255.
+            if(sum < 0) sum = 0;
+            else if(sum > 255) sum = 255;
+            lap[c] = sum;
+            if(sum > strongest) strongest = sum;
+        }
+
+        if(out->laplacian)
+        {
+            out->laplacian[index].r = lap[0];
+            out->laplacian[index].g = lap[1];
+            out->laplacian[index].b = lap[2];
+        }
+        if(out->mask)
+        {
+            out->mask[index] = strongest >= out->threshold ? 255 : 0;
+        }
+        if(out->sharpen)
+        {
+            out->sharpen[index].r = sharp[0];
+            out->sharpen[index].g = sharp[1];
+            out->sharpen[index].b = sharp[2];
+        }
+    }
+
+    if(out->sobel || out->dizenzo || out->magnitude || out->tensor)
+    {
+        int gx[3], gy[3];
+        for(int c = 0; c < 3; c++)
+        {
+            int (*win)[FILTER_WIDTH] = window[c];
+            gx[c] = (win[0][2] + 2 * win[1][2] + win[2][2]) - (win[0][0] + 2 * win[1][0] + win[2][0]);
+            gy[c] = (win[2][0] + 2 * win[2][1] + win[2][2]) - (win[0][0] + 2 * win[0][1] + win[0][2]);
+        }
+        if(out->sobel)
+        {
+            out->sobel[index].r = sobel_magnitude(gx[0], gy[0]);
+            out->sobel[index].g = sobel_magnitude(gx[1], gy[1]);
+            out->sobel[index].b = sobel_magnitude(gx[2], gy[2]);
+        }
+        if(out->dizenzo)
+        {
+            out->dizenzo[index] = dizenzo_magnitude(gx, gy);
+        }
+        if(out->magnitude)
+        {
+            int channel = 0;
+            for(int c = 1; c < 3; c++)
+            {
+                if(gx[c] * gx[c] + gy[c] * gy[c] > gx[channel] * gx[channel] + gy[channel] * gy[channel]) channel = c;
+            }
+            float angle = atan2f(gy[channel], gx[channel]) * (float)(180 / M_PI);
+            if(angle < 0) angle += 180;
+            if(angle >= 180) angle -= 180;
+            out->magnitude[index] = sqrtf((float)(gx[channel] * gx[channel] + gy[channel] * gy[channel]));
+            out->orientation[index] = angle;
+        }
+        if(out->tensor)
+        {
+            float xx = 0, yy = 0, xy = 0;
+            for(int c = 0; c < 3; c++)
+            {
+                xx += gx[c] * gx[c];
+                yy += gy[c] * gy[c];
+                xy += gx[c] * gy[c];
+            }
+            out->tensor[3*index] = xx;
+            out->tensor[3*index+1] = yy;
+            out->tensor[3*index+2] = xy;
+        }
+    }
+    return strongest;
+}
+
+/* Return: row y of an image whose rows are stride bytes apart. */
+const PPMPixel *image_row(const PPMPixel *image, unsigned long int stride, unsigned long int y)
+{
+    return (const PPMPixel *)((const unsigned char *)image + y * stride);
+}
 
-    int red, green, blue;
+/* Return: 1 if every pixel of the tile x0..x1, y0..y1 (ends exclusive) and of its one pixel halo, wrapping around the
+ image edges, equals the pixel in pattern. pattern holds x1-x0+2 copies of that pixel, so each halo row is one memcmp.
+ */
+int tile_is_uniform(const PPMPixel *image, unsigned long int stride, unsigned long int w, unsigned long int h, unsigned long int x0, unsigned long int x1, unsigned long int y0, unsigned long int y1, const PPMPixel *pattern)
+{
+    unsigned long int from = x0 > 0 ? x0 - 1 : 0;
+    unsigned long int to = x1 < w ? x1 + 1 : w;
+    for(unsigned long int y = y0 + h - 1; y <= y1 + h; y++)
+    {
+        const PPMPixel *row = image_row(image, stride, y % h);
+        if(memcmp(row + from, pattern, (to - from) * sizeof(PPMPixel)) != 0) return 0;
+        if(x0 == 0 && memcmp(row + w - 1, pattern, sizeof(PPMPixel)) != 0) return 0;
+        if(x1 == w && memcmp(row, pattern, sizeof(PPMPixel)) != 0) return 0;
+    }
+    return 1;
+}
+
+/* Copy the outputs at index source to every pixel of the tile x0..x1, y0..y1 (ends exclusive). */
+void fill_flat_tile(struct filter_outputs *out, unsigned long int w, unsigned long int x0, unsigned long int x1, unsigned long int y0, unsigned long int y1, unsigned long int source)
+{
+    for(unsigned long int y = y0; y < y1; y++)
+    {
+        for(unsigned long int x = x0; x < x1; x++)
+        {
+            unsigned long int index = y * w + x;
+            if(out->laplacian) out->laplacian[index] = out->laplacian[source];
+            if(out->sobel) out->sobel[index] = out->sobel[source];
+            if(out->sharpen) out->sharpen[index] = out->sharpen[source];
+            if(out->magnitude)
+            {
+                out->magnitude[index] = out->magnitude[source];
+                out->orientation[index] = out->orientation[source];
+            }
+            if(out->tensor) memcpy(out->tensor + 3 * index, out->tensor + 3 * source, 3 * sizeof(float));
+        }
+        if(out->mask) memset(out->mask + y * w + x0, out->mask[source], x1 - x0);
+        if(out->dizenzo) memset(out->dizenzo + y * w + x0, out->dizenzo[source], x1 - x0);
+    }
+}
 
+/*This is the thread function. It will compute the new values for the region of image specified in params (start to start+size) using convolution.
+    The 3x3 window is loaded once per pixel and every operator requested in params->out is evaluated on it, so the Laplacian,
+    the Sobel magnitude and the threshold mask of an image all come out of a single pass.
+    The region is walked in FLAT_TILE x FLAT_TILE tiles. A tile whose pixels and halo are all equal gives every window the
+    same value, so only its first pixel is filtered and the result is copied over the tile; screenshots and scanned
+    documents are mostly made of such tiles.
+ 
+ */
+void *compute_laplacian_threadfn(void *params)
+{
     struct parameter *param = (struct parameter *) params;
+    struct filter_outputs *out = param->out;
+    unsigned long int w = param->w, h = param->h;
+    unsigned long int end = param->start + param->size;
+    const PPMPixel *rows[FILTER_HEIGHT];
+    const PPMPixel *previous_rows[FILTER_HEIGHT];
+    const PPMPixel *const *previous = param->previous ? previous_rows : NULL;
+    PPMPixel pattern[FLAT_TILE + 2], previous_pattern[FLAT_TILE + 2];
+    //Edge pixels are counted into a grid of this thread's own, the grids are summed after the join.
+    unsigned long int *heat = out->heatmap ? calloc(out->heatmap_rows * out->heatmap_columns, sizeof(unsigned long int)) : NULL;
+
+    param->tiles = 0;
+    param->flat_tiles = 0;
+    param->heat = heat;
 
-    int x_coordinate, y_coordinate = 0;
-    //The for-loop goes to each pixel and applying filter.
-    for(int iteratorImageWidth = 0; iteratorImageWidth < param->w; iteratorImageWidth++)
+    //The for-loop goes to each tile of the region, then to each pixel of the tile in scanline order and applying filter.
+    for(unsigned long int tile_y = param->start; tile_y < end; tile_y += FLAT_TILE)
     {
-        for(int iteratorImageHeight = param->start; iteratorImageHeight < param->start + param->size; iteratorImageHeight++)
+        unsigned long int tile_end_y = tile_y + FLAT_TILE < end ? tile_y + FLAT_TILE : end;
+        for(unsigned long int tile_x = 0; tile_x < w; tile_x += FLAT_TILE)
         {
-            red = 0;
-            green = 0;
-            blue = 0;
-            for(int iteratorFilterWidth = 0; iteratorFilterWidth < FILTER_WIDTH; iteratorFilterWidth++)
+            unsigned long int tile_end_x = tile_x + FLAT_TILE < w ? tile_x + FLAT_TILE : w;
+            param->tiles++;
+
+            if(flat_skip_enabled)
             {
-                for(int iteratorFilterHeight = 0; iteratorFilterHeight < FILTER_HEIGHT; iteratorFilterHeight++)
+                PPMPixel first = image_row(param->image, param->stride, (tile_y + h - 1) % h)[(tile_x + w - 1) % w];
+                for(unsigned long int i = 0; i < tile_end_x - tile_x + 2; i++) pattern[i] = first;
+                int uniform = tile_is_uniform(param->image, param->stride, w, h, tile_x, tile_end_x, tile_y, tile_end_y, pattern);
+                if(uniform && previous)
+                {
+                    //The difference is uniform when both frames are.
+                    first = image_row(param->previous, param->stride, (tile_y + h - 1) % h)[(tile_x + w - 1) % w];
+                    for(unsigned long int i = 0; i < tile_end_x - tile_x + 2; i++) previous_pattern[i] = first;
+                    uniform = tile_is_uniform(param->previous, param->stride, w, h, tile_x, tile_end_x, tile_y, tile_end_y, previous_pattern);
+                }
+                if(uniform)
                 {
-                    x_coordinate = ( iteratorImageWidth - FILTER_WIDTH / 2 + iteratorFilterWidth + param->w ) % param->w;
-                    y_coordinate = ( iteratorImageHeight - FILTER_HEIGHT / 2 + iteratorFilterHeight + param->h ) % param->h;
-                    red+= param->image[y_coordinate * param->w + x_coordinate].r * laplacian[iteratorFilterHeight][iteratorFilterWidth];
-                    green+= param->image[y_coordinate * param->w + x_coordinate].g * laplacian[iteratorFilterHeight][iteratorFilterWidth];
-                    blue+= param->image[y_coordinate * param->w + x_coordinate].b * laplacian[iteratorFilterHeight][iteratorFilterWidth];
+                    for(int iteratorFilterHeight = 0; iteratorFilterHeight < FILTER_HEIGHT; iteratorFilterHeight++)
+                    {
+                        rows[iteratorFilterHeight] = image_row(param->image, param->stride, ( tile_y - FILTER_HEIGHT / 2 + iteratorFilterHeight + h ) % h);
+                        if(previous) previous_rows[iteratorFilterHeight] = image_row(param->previous, param->stride, ( tile_y - FILTER_HEIGHT / 2 + iteratorFilterHeight + h ) % h);
+                    }
+                    int strongest = filter_pixel(out, rows, previous, w, tile_x, tile_y * w + tile_x);
+                    fill_flat_tile(out, w, tile_x, tile_end_x, tile_y, tile_end_y, tile_y * w + tile_x);
+                    if(heat && strongest >= out->threshold)
+                    {
+                        //Every pixel of the tile is an edge pixel, and the tile may straddle heatmap cells.
+                        for(unsigned long int y = tile_y; y < tile_end_y; y++)
+                        {
+                            unsigned long int *heat_row = heat + y * out->heatmap_rows / h * out->heatmap_columns;
+                            for(unsigned long int x = tile_x; x < tile_end_x; x++) heat_row[out->heat_column[x]]++;
+                        }
+                    }
+                    param->flat_tiles++;
+                    continue;
                 }
             }
 
-            //Truncate values smaller than zero to zero and larger than 255 to 255.
-            if(red < 0) red = 0;
-            else if(red > 255) red = 255;
-            if(green < 0) green = 0;
-            else if(green > 255) green = 255;
-            if(blue < 0) blue = 0;
-            else if(blue > 255) blue = 255;
-
-            //Adding the rgb color to results.
-            param->result[iteratorImageHeight * param->w + iteratorImageWidth].r = red;  
-            param->result[iteratorImageHeight * param->w + iteratorImageWidth].g = green; 
-            param->result[iteratorImageHeight * param->w + iteratorImageWidth].b = blue;
+            for(unsigned long int iteratorImageHeight = tile_y; iteratorImageHeight < tile_end_y; iteratorImageHeight++)
+            {
+                for(int iteratorFilterHeight = 0; iteratorFilterHeight < FILTER_HEIGHT; iteratorFilterHeight++)
+                {
+                    rows[iteratorFilterHeight] = image_row(param->image, param->stride, ( iteratorImageHeight - FILTER_HEIGHT / 2 + iteratorFilterHeight + h ) % h);
+                    if(previous) previous_rows[iteratorFilterHeight] = image_row(param->previous, param->stride, ( iteratorImageHeight - FILTER_HEIGHT / 2 + iteratorFilterHeight + h ) % h);
+                }
+                unsigned long int *heat_row = heat ? heat + iteratorImageHeight * out->heatmap_rows / h * out->heatmap_columns : NULL;
+                for(unsigned long int iteratorImageWidth = tile_x; iteratorImageWidth < tile_end_x; iteratorImageWidth++)
+                {
+                    int strongest = filter_pixel(out, rows, previous, w, iteratorImageWidth, iteratorImageHeight * w + iteratorImageWidth);
+                    if(heat_row) heat_row[out->heat_column[iteratorImageWidth]] += strongest >= out->threshold;
+                }
+            }
         }
     }
+
+    //The mask rows of the region are still in cache: encode them into the region's own run list.
+    if(out->mask_runs)
+    {
+        param->runs.count = 0;
+        run_length_encode(out->mask + param->start * w, param->size * w, &param->runs);
+    }
     return NULL;
 }
 
-/* Apply the Laplacian filter to an image using threads.
+/* Run every operator requested in out over the image using threads, in one pass over the input.
+ The rows of image are stride bytes apart, so padded buffers are filtered where they lie. With previous, a frame of the
+ same layout, the operators see |image - previous| without the difference ever being stored.
  Each thread shall do an equal share of the work, i.e. work=height/number of threads. If the size is not even, the last thread shall take the rest of the work.
- Compute the elapsed time and store it in *elapsedTime (Read about gettimeofday).
- Return: result (filtered image)
+ Compute the elapsed time and add it to *elapsedTime.
  */
-PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, double *elapsedTime) 
+void apply_fused_filters_motion(PPMPixel *image, const PPMPixel *previous, unsigned long stride, unsigned long w, unsigned long h, struct filter_outputs *out, double *elapsedTime)
 {
     struct timeval start, end;
     gettimeofday(&start, NULL);
 
-    PPMPixel *result = (PPMPixel*)malloc(w * h * sizeof(PPMPixel));
     struct parameter params[LAPLACIAN_THREADS];
     int work = h / LAPLACIAN_THREADS;
     pthread_t t[LAPLACIAN_THREADS];
@@ -122,10 +502,14 @@ PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, doubl
     for(int i = 0; i < LAPLACIAN_THREADS; i++)
     {
         params[i].image = image;
-        params[i].result = result;
+        params[i].previous = previous;
+        params[i].stride = stride;
+        params[i].out = out;
         params[i].start = i * work;
         params[i].w = w;
         params[i].h = h;
+        params[i].runs = (struct int_list){ 0 };
+        params[i].heat = NULL;
 
         //Making sure that the last thread take on the rest of the work
         if(i == LAPLACIAN_THREADS -1)
@@ -146,9 +530,23 @@ PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, doubl
        
     }
 
+    out->tiles = 0;
+    out->flat_tiles = 0;
     for(int i = 0; i < LAPLACIAN_THREADS; i++)
     {
         pthread_join(t[i], NULL);
+        out->tiles += params[i].tiles;
+        out->flat_tiles += params[i].flat_tiles;
+        if(out->mask_runs)
+        {
+            append_runs(out->mask_runs, &params[i].runs);
+        }
+        free(params[i].runs.items);
+        if(out->heatmap)
+        {
+            for(int k = 0; k < out->heatmap_rows * out->heatmap_columns; k++) out->heatmap[k] += params[i].heat[k];
+            free(params[i].heat);
+        }
     }
 
     gettimeofday(&end, NULL);
@@ -156,9 +554,155 @@ PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, doubl
     //Get the total time of threadings
     *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
     pthread_mutex_unlock(&mutex_c);
+}
+
+void apply_fused_filters_strided(PPMPixel *image, unsigned long stride, unsigned long w, unsigned long h, struct filter_outputs *out, double *elapsedTime)
+{
+    apply_fused_filters_motion(image, NULL, stride, w, h, out, elapsedTime);
+}
+
+void apply_fused_filters(PPMPixel *image, unsigned long w, unsigned long h, struct filter_outputs *out, double *elapsedTime)
+{
+    apply_fused_filters_strided(image, w * sizeof(PPMPixel), w, h, out, elapsedTime);
+}
+
+/* Apply the Laplacian filter to an image using threads.
+ Return: result (filtered image)
+ */
+PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, double *elapsedTime) 
+{
+    struct filter_outputs out = { 0 };
+    out.laplacian = (PPMPixel*)malloc(w * h * sizeof(PPMPixel));
+    out.threshold = threshold_value;
+    apply_fused_filters(image, w, h, &out, elapsedTime);
+    return out.laplacian;
+}
+
+/* Single channel images.
+ Luma planes are filtered where they lie: stride is the distance in bytes between rows and step the distance between
+ horizontally adjacent samples, so a Y plane inside a camera buffer (step 1) or the Y bytes of packed YUYV (step 2)
+ are read without first being copied out.
+ */
+struct gray_parameter {
+    const unsigned char *image;  //first sample of the plane
+    const unsigned char *previous; //motion mode: the same plane of the frame before; NULL otherwise
+    unsigned long int stride;    //bytes from one row to the next
+    unsigned long int step;      //bytes from one sample to the next within a row
+    unsigned char *result;       //filtered plane, width * height bytes
+    unsigned long int w;         //width of image
+    unsigned long int h;         //height of image
+    unsigned long int start;     //starting point of work
+    unsigned long int size;      //equal share of work (almost equal if odd)
+};
+
+/* This is the thread function for single channel planes: the same Laplacian as compute_laplacian_threadfn, truncated
+ to 0..255, on rows start to start+size. Columns 1..w-2 need no wraparound and run as one straight loop per row.
+ */
+void *compute_laplacian_gray_threadfn(void *params)
+{
+    struct gray_parameter *param = (struct gray_parameter *) params;
+    unsigned long int w = param->w, h = param->h, step = param->step;
+
+    for(unsigned long int y = param->start; y < param->start + param->size; y++)
+    {
+        const unsigned char *a = param->image + (y + h - 1) % h * param->stride;
+        const unsigned char *b = param->image + y * param->stride;
+        const unsigned char *c = param->image + (y + 1) % h * param->stride;
+        unsigned char *out = param->result + y * w;
+
+        if(param->previous)
+        {
+            //Motion mode: the window holds |image - previous|, taken as it is read.
+            const unsigned char *pa = param->previous + (y + h - 1) % h * param->stride;
+            const unsigned char *pb = param->previous + y * param->stride;
+            const unsigned char *pc = param->previous + (y + 1) % h * param->stride;
+            for(unsigned long int x = 0; x < w; x++)
+            {
+                unsigned long int l = (x + w - 1) % w * step, m = x * step, r = (x + 1) % w * step;
+                int sum = 8 * abs(b[m] - pb[m]) - abs(a[l] - pa[l]) - abs(a[m] - pa[m]) - abs(a[r] - pa[r]) - abs(b[l] - pb[l]) - abs(b[r] - pb[r])
+                          - abs(c[l] - pc[l]) - abs(c[m] - pc[m]) - abs(c[r] - pc[r]);
+                out[x] = clamp_pixel(sum);
+            }
+            continue;
+        }
+
+        if(step == 1)
+        {
+            for(unsigned long int x = 1; x + 1 < w; x++)
+            {
+                int sum = 8 * b[x] - a[x-1] - a[x] - a[x+1] - b[x-1] - b[x+1] - c[x-1] - c[x] - c[x+1];
+                out[x] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+            }
+        }
+        else
+        {
+            for(unsigned long int x = 1; x + 1 < w; x++)
+            {
+                unsigned long int l = (x - 1) * step, m = x * step, r = (x + 1) * step;
+                int sum = 8 * b[m] - a[l] - a[m] - a[r] - b[l] - b[r] - c[l] - c[m] - c[r];
+                out[x] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+            }
+        }
+
+        //The first and last columns wrap around.
+        for(unsigned long int x = 0; x < w; x += (w > 1 ? w - 1 : 1))
+        {
+            unsigned long int l = (x + w - 1) % w * step, m = x * step, r = (x + 1) % w * step;
+            int sum = 8 * b[m] - a[l] - a[m] - a[r] - b[l] - b[r] - c[l] - c[m] - c[r];
+            out[x] = clamp_pixel(sum);
+        }
+    }
+    return NULL;
+}
+
+/* Apply the Laplacian filter to a single channel plane using threads, split into bands like apply_filters.
+ With previous, a plane of the same layout, the Laplacian of |image - previous| is computed instead.
+ Return: result (filtered plane, width * height bytes)
+ */
+unsigned char *apply_filters_gray_motion(const unsigned char *image, const unsigned char *previous, unsigned long stride, unsigned long step, unsigned long w, unsigned long h, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    unsigned char *result = malloc(w * h);
+    struct gray_parameter params[LAPLACIAN_THREADS];
+    pthread_t t[LAPLACIAN_THREADS];
+    int work = h / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].image = image;
+        params[i].previous = previous;
+        params[i].stride = stride;
+        params[i].step = step;
+        params[i].result = result;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : work;
+        if(pthread_create(&t[i], NULL, compute_laplacian_gray_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(t[i], NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
     return result;
 }
 
+unsigned char *apply_filters_gray(const unsigned char *image, unsigned long stride, unsigned long step, unsigned long w, unsigned long h, double *elapsedTime)
+{
+    return apply_filters_gray_motion(image, NULL, stride, step, w, h, elapsedTime);
+}
+
 /*Create a new P6 file to save the filtered image in. Write the header block
  e.g. P6
       Width Height
@@ -183,6 +727,73 @@ void write_image(PPMPixel *image, char *filename, unsigned long int width, unsig
     fclose(fp); 
 }
 
+/*Create a new P5 file to save a single channel image in, with the same header block as write_image but magic "P5".
+ */
+void write_gray_image(unsigned char *image, char *filename, unsigned long int width, unsigned long int height)
+{
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return;
+    }
+    fprintf(fp, "P5\n");
+    fprintf(fp, "%lu %lu\n", width, height);
+    fprintf(fp, "%d\n", RGB_COMPONENT_COLOR);
+    fwrite(image, width, height, fp);
+
+    fclose(fp);
+}
+
+/* Write the result of one operator in the format asked for by spec.
+ Three channel results written as PGM keep their strongest channel, single channel results written as PPM are replicated into r, g and b.
+ */
+void write_output(struct output_spec *spec, struct filter_outputs *out, char *filename, unsigned long int width, unsigned long int height)
+{
+    PPMPixel *color = NULL;
+    unsigned char *gray = NULL;
+    switch(spec->op)
+    {
+        case OP_LAPLACIAN: color = out->laplacian; break;
+        case OP_SOBEL:     color = out->sobel; break;
+        case OP_SHARPEN:   color = out->sharpen; break;
+        case OP_THRESHOLD: gray = out->mask; break;
+        case OP_DIZENZO:   gray = out->dizenzo; break;
+        case OP_THIN:      gray = out->thin; break;
+        default: return;
+    }
+
+    if(color && spec->format == FORMAT_PPM)
+    {
+        write_image(color, filename, width, height);
+    }
+    else if(gray && spec->format == FORMAT_PGM)
+    {
+        write_gray_image(gray, filename, width, height);
+    }
+    else if(color)
+    {
+        unsigned char *reduced = malloc(width * height);
+        for(unsigned long int i = 0; i < width * height; i++)
+        {
+            unsigned char m = color[i].r > color[i].g ? color[i].r : color[i].g;
+            reduced[i] = m > color[i].b ? m : color[i].b;
+        }
+        write_gray_image(reduced, filename, width, height);
+        free(reduced);
+    }
+    else
+    {
+        PPMPixel *expanded = malloc(width * height * sizeof(PPMPixel));
+        for(unsigned long int i = 0; i < width * height; i++)
+        {
+            expanded[i].r = expanded[i].g = expanded[i].b = gray[i];
+        }
+        write_image(expanded, filename, width, height);
+        free(expanded);
+    }
+}
+
 /* Open the filename image for reading, and parse it.
     Example of a ppm header:    //http://netpbm.sourceforge.net/doc/ppm.html
     P6                  -- image format
@@ -262,61 +873,6047 @@ PPMPixel *read_image(const char *filename, unsigned long int *width, unsigned lo
     return img;
 }
 
-/* The thread function that manages an image file. 
- Read an image file that is passed as an argument at runtime. 
- Apply the Laplacian filter. 
- Save the result image in a file called laplaciani.ppm, where i is the image file order in the passed arguments.
- Example: the result image of the file passed third during the input shall be called "laplacian3.ppm".
-*/
-void *manage_image_file(void *args)
-{
-    //Initializing file_name_args
-    struct file_name_args* file_name = (struct file_name_args*) args;
+/* Filter pipelines.
+ A pipeline is a chain of stages described as "stage[:arg],stage[:arg],...", e.g. "blur,laplacian,threshold:40,dilate".
+ Pointwise stages map a pixel to a pixel, stencil stages read a (2*radius+1)^2 neighbourhood with the same toroidal
+ wraparound as compute_laplacian_threadfn, and global stages need the whole image before they can produce anything.
+ The planner fuses consecutive pointwise and stencil stages into one tiled pass: each thread walks its band in tiles
+ of PIPELINE_TILE_ROWS rows, loads the tile plus the halo all fused stencils need, and runs every stage on the tile
+ while it is in cache, each stencil shrinking the halo by its radius. Full size intermediate images are only used
+ around global stages and where the halo of a fused pass would grow past PIPELINE_MAX_HALO.
+ */
+#define MAX_STAGES 16
+#define PIPELINE_TILE_ROWS 32                        //rows per tile in a fused pass
+#define PIPELINE_MAX_HALO (PIPELINE_TILE_ROWS / 2)   //a fused pass is split when its halo grows past this
+
+enum stage_kind { STAGE_POINTWISE, STAGE_STENCIL, STAGE_GLOBAL };
+const char *stage_kind_names[] = { "pointwise", "stencil", "global" };
+
+struct stage;
+
+struct stage_def {
+    const char *name;
+    enum stage_kind kind;
+    int radius;              //neighbours a stencil reads on each side
+    int default_arg;
+    //stencil: compute one output row from rows[0..2*radius], each row readable from -radius to w+radius-1
+    void (*row)(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w);
+    //pointwise: transform a row in place
+    void (*point)(const struct stage *stage, PPMPixel *row, unsigned long int w);
+    //global: transform a whole image into out
+    void (*global)(const struct stage *stage, PPMPixel *in, PPMPixel *out, unsigned long int w, unsigned long int h);
+};
+
+struct stage {
+    const struct stage_def *def;
+    int arg;
+    int radius;
+};
+
+struct pipeline {
+    struct stage stages[MAX_STAGES];
+    int count;
+};
+
+/* A pass of the schedule: stages[first..first+count) of the pipeline run together. */
+struct pipeline_pass {
+    int first;
+    int count;
+    int halo;                //rows of context loaded above and below each tile
+    int pad;                 //columns of context kept left and right of each row
+    int buffered;            //1 for a global stage working on whole image buffers
+};
+
+struct pipeline_parameter {
+    const struct pipeline *pipeline;
+    const struct pipeline_pass *pass;
+    PPMPixel *image;         //input of the pass
+    PPMPixel *result;        //output of the pass
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int start;
+    unsigned long int size;
+    double stage_seconds[MAX_STAGES];   //time this thread spent in each stage
+};
+
+struct pipeline active_pipeline;
+int pipeline_enabled = 0;
+int pipeline_schedule = 0;
+pthread_mutex_t mutex_schedule = PTHREAD_MUTEX_INITIALIZER;
+
+void stage_blur_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    const PPMPixel *a = rows[0], *b = rows[1], *c = rows[2];
+    for(long int x = 0; x < (long int)w; x++)
+    {
+        out[x].r = (a[x-1].r + 2*a[x].r + a[x+1].r + 2*(b[x-1].r + 2*b[x].r + b[x+1].r) + c[x-1].r + 2*c[x].r + c[x+1].r + 8) >> 4;
+        out[x].g = (a[x-1].g + 2*a[x].g + a[x+1].g + 2*(b[x-1].g + 2*b[x].g + b[x+1].g) + c[x-1].g + 2*c[x].g + c[x+1].g + 8) >> 4;
+        out[x].b = (a[x-1].b + 2*a[x].b + a[x+1].b + 2*(b[x-1].b + 2*b[x].b + b[x+1].b) + c[x-1].b + 2*c[x].b + c[x+1].b + 8) >> 4;
+    }
+}
+
+void stage_laplacian_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    const PPMPixel *a = rows[0], *b = rows[1], *c = rows[2];
+    for(long int x = 0; x < (long int)w; x++)
+    {
+        out[x].r = clamp_pixel(8*b[x].r - a[x-1].r - a[x].r - a[x+1].r - b[x-1].r - b[x+1].r - c[x-1].r - c[x].r - c[x+1].r);
+        out[x].g = clamp_pixel(8*b[x].g - a[x-1].g - a[x].g - a[x+1].g - b[x-1].g - b[x+1].g - c[x-1].g - c[x].g - c[x+1].g);
+        out[x].b = clamp_pixel(8*b[x].b - a[x-1].b - a[x].b - a[x+1].b - b[x-1].b - b[x+1].b - c[x-1].b - c[x].b - c[x+1].b);
+    }
+}
+
+void stage_sobel_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    const PPMPixel *a = rows[0], *b = rows[1], *c = rows[2];
+    for(long int x = 0; x < (long int)w; x++)
+    {
+        out[x].r = sobel_magnitude((a[x+1].r + 2*b[x+1].r + c[x+1].r) - (a[x-1].r + 2*b[x-1].r + c[x-1].r), (c[x-1].r + 2*c[x].r + c[x+1].r) - (a[x-1].r + 2*a[x].r + a[x+1].r));
+        out[x].g = sobel_magnitude((a[x+1].g + 2*b[x+1].g + c[x+1].g) - (a[x-1].g + 2*b[x-1].g + c[x-1].g), (c[x-1].g + 2*c[x].g + c[x+1].g) - (a[x-1].g + 2*a[x].g + a[x+1].g));
+        out[x].b = sobel_magnitude((a[x+1].b + 2*b[x+1].b + c[x+1].b) - (a[x-1].b + 2*b[x-1].b + c[x-1].b), (c[x-1].b + 2*c[x].b + c[x+1].b) - (a[x-1].b + 2*a[x].b + a[x+1].b));
+    }
+}
+
+/* Dilation (max) or erosion (min) over the 3x3 neighbourhood, per channel. */
+void morphology_row(const PPMPixel *const *rows, PPMPixel *out, unsigned long int w, int dilate)
+{
+    for(long int x = 0; x < (long int)w; x++)
+    {
+        PPMPixel v = rows[1][x];
+        for(int k = 0; k < 3; k++)
+        {
+            for(int j = -1; j <= 1; j++)
+            {
+                PPMPixel p = rows[k][x + j];
+                if(dilate)
+                {
+                    if(p.r > v.r) v.r = p.r;
+                    if(p.g > v.g) v.g = p.g;
+                    if(p.b > v.b) v.b = p.b;
+                }
+                else
+                {
+                    if(p.r < v.r) v.r = p.r;
+                    if(p.g < v.g) v.g = p.g;
+                    if(p.b < v.b) v.b = p.b;
+                }
+            }
+        }
+        out[x] = v;
+    }
+}
+
+void stage_dilate_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    morphology_row(rows, out, w, 1);
+}
+
+void stage_erode_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    morphology_row(rows, out, w, 0);
+}
+
+/* Median filters.
+ The median of each channel is taken independently, so a row of pixels is treated as 3w bytes and filtered 16 bytes at
+ a time with unsigned byte min/max, a sorting network over vectors. Byte j reads its neighbours at j-3 and j+3.
+ 3x3: each column of three is sorted once into low, middle and high values and shared by the three pixels that read it;
+ the median is the median of (largest low, median of middles, smallest high).
+ 5x5: the columns of five are sorted once and shared the same way. For each pixel the five columns are then sorted
+ across, rank by rank, which keeps the columns sorted; a value that is j-th in its row and k-th in its column is then
+ above at least (j+1)(k+1)-1 others and below at least (5-j)(5-k)-1, which rules out 12 of the 25 as the median.
+ The remaining 13 go through forgetful selection: the first 8 are loaded, the smallest and largest dropped, the next
+ value takes their place, and so on until three are left, whose median is the result.
+ */
+#define MEDIAN_CHUNK 256         //output bytes per block of sorted columns
+
+#if defined(__x86_64__)
+typedef __m128i byte_vector;
+#define load_vector(p) _mm_loadu_si128((const __m128i *)(p))
+#define store_vector(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define min_vector(a, b) _mm_min_epu8((a), (b))
+#define max_vector(a, b) _mm_max_epu8((a), (b))
+#else
+typedef struct { unsigned char v[16]; } byte_vector;
+
+byte_vector load_vector(const unsigned char *p)
+{
+    byte_vector r;
+    memcpy(r.v, p, 16);
+    return r;
+}
+
+void store_vector(unsigned char *p, byte_vector v)
+{
+    memcpy(p, v.v, 16);
+}
+
+byte_vector min_vector(byte_vector a, byte_vector b)
+{
+    for(int i = 0; i < 16; i++) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+    return a;
+}
+
+byte_vector max_vector(byte_vector a, byte_vector b)
+{
+    for(int i = 0; i < 16; i++) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+    return a;
+}
+#endif
+
+/* Compare-exchange: *a gets the smaller bytes, *b the larger. */
+void sort_vectors(byte_vector *a, byte_vector *b)
+{
+    byte_vector t = min_vector(*a, *b);
+    *b = max_vector(*a, *b);
+    *a = t;
+}
+
+byte_vector median3_vector(byte_vector a, byte_vector b, byte_vector c)
+{
+    return max_vector(min_vector(a, b), min_vector(max_vector(a, b), c));
+}
+
+/* Median of count (odd, at most 13) vectors by forgetful selection. values is reordered. */
+byte_vector forgetful_median(byte_vector *values, int count)
+{
+    int r = count / 2 + 2;
+    byte_vector *window = values;
+    for(int next = r; next < count; next++)
+    {
+        //Smallest to window[0], largest to window[r-1], then both are dropped and the next value comes in.
+        for(int i = 1; i < r; i++) sort_vectors(&window[0], &window[i]);
+        for(int i = 1; i < r - 1; i++) sort_vectors(&window[i], &window[r-1]);
+        window[r-1] = values[next];
+        window++;
+        r--;
+    }
+    return median3_vector(window[0], window[1], window[2]);
+}
+
+/* Sort five vectors with a nine comparator network. */
+void sort5_vectors(byte_vector *v)
+{
+    sort_vectors(&v[0], &v[1]);
+    sort_vectors(&v[3], &v[4]);
+    sort_vectors(&v[2], &v[4]);
+    sort_vectors(&v[2], &v[3]);
+    sort_vectors(&v[0], &v[3]);
+    sort_vectors(&v[0], &v[2]);
+    sort_vectors(&v[1], &v[4]);
+    sort_vectors(&v[1], &v[3]);
+    sort_vectors(&v[1], &v[2]);
+}
+
+/* Per byte median for rows too narrow for a vector. */
+void median_row_scalar(const PPMPixel *const *rows, PPMPixel *out, unsigned long int w, int radius)
+{
+    unsigned char *o = (unsigned char *)out;
+    int side = 2 * radius + 1;
+    for(long int j = 0; j < 3 * (long int)w; j++)
+    {
+        unsigned char values[25];
+        int count = 0;
+        for(int dy = 0; dy < side; dy++)
+        {
+            const unsigned char *row = (const unsigned char *)rows[dy];
+            for(int dx = -radius; dx <= radius; dx++)
+            {
+                //Insertion sort while gathering.
+                unsigned char v = row[j + 3 * dx];
+                int i = count++;
+                while(i > 0 && values[i-1] > v)
+                {
+                    values[i] = values[i-1];
+                    i--;
+                }
+                values[i] = v;
+            }
+        }
+        o[j] = values[count / 2];
+    }
+}
+
+void stage_median3_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    const unsigned char *a = (const unsigned char *)rows[0], *b = (const unsigned char *)rows[1], *c = (const unsigned char *)rows[2];
+    unsigned char *o = (unsigned char *)out;
+    unsigned char lo[MEDIAN_CHUNK + 32], mid[MEDIAN_CHUNK + 32], hi[MEDIAN_CHUNK + 32];
+    long int n = 3 * (long int)w;
+
+    if(n < 16)
+    {
+        median_row_scalar(rows, out, w, 1);
+        return;
+    }
+    for(long int j0 = 0; j0 < n; )
+    {
+        //The last block takes the remainder whole, so every block is at least one vector long.
+        long int j1 = n - j0 < MEDIAN_CHUNK + 16 ? n : j0 + MEDIAN_CHUNK;
+        long int length = j1 - j0, span = length + 6;
+
+        //Sorted columns of bytes j0-3 to j1+2; vectors that would run past the end are moved back to overlap the previous one.
+        for(long int k = 0; ; k += 16)
+        {
+            if(k + 16 > span) k = span - 16;
+            byte_vector x = load_vector(a + j0 - 3 + k), y = load_vector(b + j0 - 3 + k), z = load_vector(c + j0 - 3 + k);
+            sort_vectors(&x, &y);
+            sort_vectors(&y, &z);
+            sort_vectors(&x, &y);
+            store_vector(lo + k, x);
+            store_vector(mid + k, y);
+            store_vector(hi + k, z);
+            if(k + 16 >= span) break;
+        }
+        for(long int k = 0; ; k += 16)
+        {
+            if(k + 16 > length) k = length - 16;
+            byte_vector low = max_vector(max_vector(load_vector(lo + k), load_vector(lo + k + 3)), load_vector(lo + k + 6));
+            byte_vector middle = median3_vector(load_vector(mid + k), load_vector(mid + k + 3), load_vector(mid + k + 6));
+            byte_vector high = min_vector(min_vector(load_vector(hi + k), load_vector(hi + k + 3)), load_vector(hi + k + 6));
+            store_vector(o + j0 + k, median3_vector(low, middle, high));
+            if(k + 16 >= length) break;
+        }
+        j0 = j1;
+    }
+}
+
+void stage_median5_row(const struct stage *stage, const PPMPixel *const *rows, PPMPixel *out, unsigned long int w)
+{
+    //Row k of the candidates: the first and last positions j of the sorted row that can still hold the median.
+    const int first[5] = { 3, 2, 1, 0, 0 }, last[5] = { 4, 4, 3, 2, 1 };
+    unsigned char *o = (unsigned char *)out;
+    unsigned char sorted[5][MEDIAN_CHUNK + 32];
+    long int n = 3 * (long int)w;
+
+    if(n < 16)
+    {
+        median_row_scalar(rows, out, w, 2);
+        return;
+    }
+    for(long int j0 = 0; j0 < n; )
+    {
+        long int j1 = n - j0 < MEDIAN_CHUNK + 16 ? n : j0 + MEDIAN_CHUNK;
+        long int length = j1 - j0, span = length + 12;
+
+        //Sorted columns of bytes j0-6 to j1+5.
+        for(long int k = 0; ; k += 16)
+        {
+            if(k + 16 > span) k = span - 16;
+            byte_vector column[5];
+            for(int dy = 0; dy < 5; dy++) column[dy] = load_vector((const unsigned char *)rows[dy] + j0 - 6 + k);
+            sort5_vectors(column);
+            for(int dy = 0; dy < 5; dy++) store_vector(sorted[dy] + k, column[dy]);
+            if(k + 16 >= span) break;
+        }
+        for(long int k = 0; ; k += 16)
+        {
+            if(k + 16 > length) k = length - 16;
+            byte_vector candidates[13];
+            int count = 0;
+            for(int rank = 0; rank < 5; rank++)
+            {
+                byte_vector row[5];
+                for(int dx = 0; dx < 5; dx++) row[dx] = load_vector(sorted[rank] + k + 3 * dx);
+                sort5_vectors(row);
+                for(int j = first[rank]; j <= last[rank]; j++) candidates[count++] = row[j];
+            }
+            store_vector(o + j0 + k, forgetful_median(candidates, count));
+            if(k + 16 >= length) break;
+        }
+        j0 = j1;
+    }
+}
+
+void stage_threshold_point(const struct stage *stage, PPMPixel *row, unsigned long int w)
+{
+    for(unsigned long int x = 0; x < w; x++)
+    {
+        unsigned char m = row[x].r > row[x].g ? row[x].r : row[x].g;
+        if(row[x].b > m) m = row[x].b;
+        row[x].r = row[x].g = row[x].b = m >= stage->arg ? 255 : 0;
+    }
+}
+
+void stage_invert_point(const struct stage *stage, PPMPixel *row, unsigned long int w)
+{
+    for(unsigned long int x = 0; x < w; x++)
+    {
+        row[x].r = 255 - row[x].r;
+        row[x].g = 255 - row[x].g;
+        row[x].b = 255 - row[x].b;
+    }
+}
+
+/* Integral image stages.
+ box:R and lcn:R read (2R+1)^2 windows, which would cost O(R^2) per pixel as stencils; instead they are global stages
+ built on an integral image, so every window is four lookups whatever its size. The integral image is built by the
+ usual bands: each thread takes the row prefix sums of its rows and accumulates them down the band as if the band
+ started the image, the per column totals of the bands above are then chained into a carry for each band, and a
+ second threaded pass adds it. Sums are 64-bit, so neither size nor squared samples can overflow them.
+ Windows wrap around the image edges like every other filter, splitting into up to four rectangles, and are limited
+ to the image size.
+ */
+#define DEFAULT_BOX_RADIUS 7     //box and lcn use 15x15 windows unless told otherwise
+#define LCN_MIN_DEVIATION 2.0    //local standard deviation below which lcn stops amplifying contrast
+
+enum integral_phase { INTEGRAL_ROWS, INTEGRAL_CARRY, INTEGRAL_BOX, INTEGRAL_LCN };
+
+struct integral_parameter {
+    enum integral_phase phase;
+    const struct stage *stage;
+    const PPMPixel *image;
+    PPMPixel *result;
+    uint64_t *sums;              //(w+1) x (h+1) x 3: sums of the samples above and left of each point, row 0 and column 0 are 0
+    uint64_t *squares;           //the same for squared samples, NULL if not needed
+    const uint64_t *carry;       //INTEGRAL_CARRY: row h of the bands above, added to every row of this band
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int start;
+    unsigned long int size;
+};
+
+/* Sum of channel c over the rows y0..y1 and columns x0..x1 (ends exclusive) of an integral image. */
+uint64_t integral_rectangle(const uint64_t *integral, unsigned long int w, unsigned long int x0, unsigned long int x1, unsigned long int y0, unsigned long int y1, int c)
+{
+    unsigned long int row = (w + 1) * 3;
+    return integral[y1 * row + x1 * 3 + c] - integral[y0 * row + x1 * 3 + c] - integral[y1 * row + x0 * 3 + c] + integral[y0 * row + x0 * 3 + c];
+}
+
+/* Sum of channel c over the window of radius rx, ry around x, y, wrapping around the edges. Needs 2*rx < w, 2*ry < h. */
+uint64_t integral_window(const uint64_t *integral, unsigned long int w, unsigned long int h, long int x, long int y, long int rx, long int ry, int c)
+{
+    long int xs[4], ys[4];
+    int nx = 0, ny = 0;
+    long int lo = x - rx, hi = x + rx + 1;
+
+    //Each range is one interval, or two when it wraps.
+    if(lo < 0) { xs[nx++] = lo + w; xs[nx++] = w; lo = 0; }
+    if(hi > (long int)w) { xs[nx++] = 0; xs[nx++] = hi - w; hi = w; }
+    xs[nx++] = lo;
+    xs[nx++] = hi;
+    lo = y - ry;
+    hi = y + ry + 1;
+    if(lo < 0) { ys[ny++] = lo + h; ys[ny++] = h; lo = 0; }
+    if(hi > (long int)h) { ys[ny++] = 0; ys[ny++] = hi - h; hi = h; }
+    ys[ny++] = lo;
+    ys[ny++] = hi;
+
+    uint64_t sum = 0;
+    for(int i = 0; i < nx; i += 2)
+    {
+        for(int j = 0; j < ny; j += 2)
+        {
+            sum += integral_rectangle(integral, w, xs[i], xs[i+1], ys[j], ys[j+1], c);
+        }
+    }
+    return sum;
+}
+
+/* This is the thread function of the integral image stages, for rows start to start+size.
+ INTEGRAL_ROWS: integral image rows start+1 to start+size, as if the band started the image.
+ INTEGRAL_CARRY: add carry to those rows.
+ INTEGRAL_BOX, INTEGRAL_LCN: the output rows of the stage.
+ */
+void *compute_integral_threadfn(void *params)
+{
+    struct integral_parameter *param = (struct integral_parameter *) params;
+    unsigned long int w = param->w, h = param->h, row = (w + 1) * 3;
+
+    if(param->phase == INTEGRAL_ROWS)
+    {
+        for(unsigned long int y = param->start; y < param->start + param->size; y++)
+        {
+            uint64_t running[3] = { 0, 0, 0 }, running_squares[3] = { 0, 0, 0 };
+            uint64_t *sums = param->sums + (y + 1) * row, *squares = param->squares ? param->squares + (y + 1) * row : NULL;
+            const PPMPixel *pixels = param->image + y * w;
+            int first = y == param->start;
+            for(unsigned long int x = 0; x < w; x++)
+            {
+                unsigned char v[3] = { pixels[x].r, pixels[x].g, pixels[x].b };
+                for(int c = 0; c < 3; c++)
+                {
+                    running[c] += v[c];
+                    sums[(x + 1) * 3 + c] = running[c] + (first ? 0 : sums[(x + 1) * 3 + c - row]);
+                    if(squares)
+                    {
+                        running_squares[c] += v[c] * v[c];
+                        squares[(x + 1) * 3 + c] = running_squares[c] + (first ? 0 : squares[(x + 1) * 3 + c - row]);
+                    }
+                }
+            }
+        }
+    }
+    else if(param->phase == INTEGRAL_CARRY)
+    {
+        for(unsigned long int y = param->start + 1; y <= param->start + param->size; y++)
+        {
+            for(unsigned long int i = 3; i < row; i++)
+            {
+                param->sums[y * row + i] += param->carry[i];
+                if(param->squares) param->squares[y * row + i] += param->carry[row + i];
+            }
+        }
+    }
+    else
+    {
+        long int radius = param->stage->arg < 1 ? 1 : param->stage->arg;
+        long int rx = radius < (long int)(w - 1) / 2 ? radius : (long int)(w - 1) / 2;
+        long int ry = radius < (long int)(h - 1) / 2 ? radius : (long int)(h - 1) / 2;
+        uint64_t n = (uint64_t)(2 * rx + 1) * (2 * ry + 1);
+
+        for(unsigned long int y = param->start; y < param->start + param->size; y++)
+        {
+            for(unsigned long int x = 0; x < w; x++)
+            {
+                const unsigned char *in = &param->image[y * w + x].r;
+                unsigned char *out = &param->result[y * w + x].r;
+                for(int c = 0; c < 3; c++)
+                {
+                    uint64_t sum = integral_window(param->sums, w, h, x, y, rx, ry, c);
+                    if(param->phase == INTEGRAL_BOX)
+                    {
+                        out[c] = (sum + n / 2) / n;
+                        continue;
+                    }
+                    //Local contrast normalisation: distance from the local mean in local standard deviations, centred on 128.
+                    double mean = (double)sum / n;
+                    double variance = (double)integral_window(param->squares, w, h, x, y, rx, ry, c) / n - mean * mean;
+                    double deviation = variance > 0 ? sqrt(variance) : 0;
+                    if(deviation < LCN_MIN_DEVIATION) deviation = LCN_MIN_DEVIATION;
+                    out[c] = clamp_pixel((int)lround(128 + 64 * (in[c] - mean) / deviation));
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void run_integral_phase(struct integral_parameter *params, enum integral_phase phase)
+{
+    pthread_t threads[LAPLACIAN_THREADS];
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = phase;
+        if(pthread_create(&threads[i], NULL, compute_integral_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Build the integral image of in (and of its squares for lcn) in parallel and run the box or lcn stage into out. */
+void integral_stage(const struct stage *stage, PPMPixel *in, PPMPixel *out, unsigned long int w, unsigned long int h, enum integral_phase phase)
+{
+    struct integral_parameter params[LAPLACIAN_THREADS];
+    unsigned long int row = (w + 1) * 3;
+    uint64_t *sums = calloc(row * (h + 1), sizeof(uint64_t));
+    uint64_t *squares = phase == INTEGRAL_LCN ? calloc(row * (h + 1), sizeof(uint64_t)) : NULL;
+    uint64_t *carry = calloc(LAPLACIAN_THREADS * 2 * row, sizeof(uint64_t));
+    int work = h / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].stage = stage;
+        params[i].image = in;
+        params[i].result = out;
+        params[i].sums = sums;
+        params[i].squares = squares;
+        params[i].carry = carry + i * 2 * row;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : (unsigned long int)work;
+    }
+    run_integral_phase(params, INTEGRAL_ROWS);
+
+    //The carry of a band is the carry of the band above plus that band's last row.
+    for(int i = 1; i < LAPLACIAN_THREADS; i++)
+    {
+        uint64_t *previous = carry + (i - 1) * 2 * row, *current = carry + i * 2 * row;
+        unsigned long int last = params[i-1].start + params[i-1].size;
+        for(unsigned long int j = 0; j < row; j++)
+        {
+            current[j] = previous[j] + sums[last * row + j];
+            if(squares) current[row + j] = previous[row + j] + squares[last * row + j];
+        }
+    }
+    run_integral_phase(params, INTEGRAL_CARRY);
+    run_integral_phase(params, phase);
+
+    free(carry);
+    free(squares);
+    free(sums);
+}
+
+void stage_box_global(const struct stage *stage, PPMPixel *in, PPMPixel *out, unsigned long int w, unsigned long int h)
+{
+    integral_stage(stage, in, out, w, h, INTEGRAL_BOX);
+}
+
+void stage_lcn_global(const struct stage *stage, PPMPixel *in, PPMPixel *out, unsigned long int w, unsigned long int h)
+{
+    integral_stage(stage, in, out, w, h, INTEGRAL_LCN);
+}
+
+const struct stage_def stage_defs[] = {
+    { "blur",      STAGE_STENCIL,   1, 0,                 stage_blur_row,      NULL, NULL },
+    { "laplacian", STAGE_STENCIL,   1, 0,                 stage_laplacian_row, NULL, NULL },
+    { "sobel",     STAGE_STENCIL,   1, 0,                 stage_sobel_row,     NULL, NULL },
+    { "dilate",    STAGE_STENCIL,   1, 0,                 stage_dilate_row,    NULL, NULL },
+    { "erode",     STAGE_STENCIL,   1, 0,                 stage_erode_row,     NULL, NULL },
+    { "median3",   STAGE_STENCIL,   1, 0,                 stage_median3_row,   NULL, NULL },
+    { "median5",   STAGE_STENCIL,   2, 0,                 stage_median5_row,   NULL, NULL },
+    { "threshold", STAGE_POINTWISE, 0, DEFAULT_THRESHOLD, NULL, stage_threshold_point, NULL },
+    { "invert",    STAGE_POINTWISE, 0, 0,                 NULL, stage_invert_point,    NULL },
+    { "box",       STAGE_GLOBAL,    0, DEFAULT_BOX_RADIUS, NULL, NULL, stage_box_global },
+    { "lcn",       STAGE_GLOBAL,    0, DEFAULT_BOX_RADIUS, NULL, NULL, stage_lcn_global },
+};
+#define STAGE_DEF_COUNT (sizeof(stage_defs) / sizeof(stage_defs[0]))
+
+/* Parse a pipeline description into p. Stages are separated by commas, '|' or whitespace, and '#' starts a comment
+ that runs to the end of the line, so the same syntax works on the command line and in a config file.
+ Return: 0 on success, -1 with a message on stderr otherwise.
+ */
+int parse_pipeline(const char *description, struct pipeline *p)
+{
+    char token[64];
+    const char *c = description;
+    p->count = 0;
+
+    while(*c)
+    {
+        if(*c == '#')
+        {
+            while(*c && *c != '\n') c++;
+            continue;
+        }
+        if(*c == ',' || *c == '|' || *c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+        {
+            c++;
+            continue;
+        }
+
+        size_t length = 0;
+        while(c[length] && !strchr(",| \t\r\n#", c[length])) length++;
+        if(length >= sizeof(token))
+        {
+            fprintf(stderr, "Pipeline stage name too long\n");
+            return -1;
+        }
+        memcpy(token, c, length);
+        token[length] = '\0';
+        c += length;
+
+        char *arg = strchr(token, ':');
+        if(arg) *arg++ = '\0';
+
+        unsigned long int d;
+        for(d = 0; d < STAGE_DEF_COUNT; d++)
+        {
+            if(strcmp(token, stage_defs[d].name) == 0) break;
+        }
+        if(d == STAGE_DEF_COUNT)
+        {
+            fprintf(stderr, "Unknown pipeline stage '%s'\n", token);
+            return -1;
+        }
+        if(p->count == MAX_STAGES)
+        {
+            fprintf(stderr, "A pipeline can have at most %d stages\n", MAX_STAGES);
+            return -1;
+        }
+
+        struct stage *s = &p->stages[p->count++];
+        s->def = &stage_defs[d];
+        s->arg = arg ? atoi(arg) : stage_defs[d].default_arg;
+        s->radius = s->def->kind == STAGE_STENCIL ? s->def->radius : 0;
+    }
+
+    if(p->count == 0)
+    {
+        fprintf(stderr, "Empty pipeline\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a pipeline description from the command line, or from a config file when it starts with '@'. */
+int load_pipeline(const char *arg, struct pipeline *p)
+{
+    if(arg[0] != '@')
+    {
+        return parse_pipeline(arg, p);
+    }
+
+    FILE *fp = fopen(arg + 1, "rb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", arg + 1);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *description = malloc(length + 1);
+    size_t got = fread(description, 1, length, fp);
+    description[got] = '\0';
+    fclose(fp);
+
+    int status = parse_pipeline(description, p);
+    free(description);
+    return status;
+}
+
+/* Split the pipeline into passes.
+ Pointwise and stencil stages are fused into the current tiled pass while its halo stays within PIPELINE_MAX_HALO,
+ a global stage always gets a pass of its own with whole image buffers before and after it.
+ Return: number of passes written to passes.
+ */
+int plan_pipeline(const struct pipeline *p, struct pipeline_pass *passes)
+{
+    struct pipeline_pass *current = NULL;
+    int count = 0;
+
+    for(int i = 0; i < p->count; i++)
+    {
+        const struct stage *s = &p->stages[i];
+        if(s->def->kind == STAGE_GLOBAL)
+        {
+            current = NULL;
+            passes[count].first = i;
+            passes[count].count = 1;
+            passes[count].halo = 0;
+            passes[count].pad = 0;
+            passes[count].buffered = 1;
+            count++;
+            continue;
+        }
+
+        if(current && current->halo + s->radius > PIPELINE_MAX_HALO)
+        {
+            current = NULL;
+        }
+        if(!current)
+        {
+            current = &passes[count++];
+            current->first = i;
+            current->count = 0;
+            current->halo = 0;
+            current->pad = 0;
+            current->buffered = 0;
+        }
+        current->count++;
+        current->halo += s->radius;
+        if(s->radius > current->pad) current->pad = s->radius;
+    }
+    return count;
+}
+
+/* Fill the pad columns on both sides of a row with the pixels it wraps around to. */
+void wrap_row_padding(PPMPixel *row, unsigned long int w, int pad)
+{
+    for(long int j = 1; j <= pad; j++)
+    {
+        row[-j] = row[((-j) % (long int)w + w) % w];
+        row[w - 1 + j] = row[(j - 1) % w];
+    }
+}
+
+double seconds_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* This is the thread function of a fused pass. It walks rows start to start+size in tiles; for each tile it loads the
+ tile plus pass->halo rows above and below, then runs the stages of the pass back to back on two ping-pong tile buffers.
+ Each stencil produces radius fewer rows of halo than it consumed, so after the last stage exactly the tile is left.
+ */
+void *run_pipeline_pass_threadfn(void *params)
+{
+    struct pipeline_parameter *param = (struct pipeline_parameter *) params;
+    const struct pipeline_pass *pass = param->pass;
+    long int w = param->w, h = param->h;
+    long int stride = w + 2 * pass->pad;
+    long int buffer_rows = PIPELINE_TILE_ROWS + 2 * pass->halo;
+    PPMPixel *buffer[2];
+    const PPMPixel *rows[2 * PIPELINE_MAX_HALO + 1];
+    struct timespec clock;
+
+    buffer[0] = malloc(buffer_rows * stride * sizeof(PPMPixel));
+    buffer[1] = malloc(buffer_rows * stride * sizeof(PPMPixel));
+
+    for(long int tile = param->start; tile < (long int)(param->start + param->size); tile += PIPELINE_TILE_ROWS)
+    {
+        long int tile_rows = param->start + param->size - tile;
+        if(tile_rows > PIPELINE_TILE_ROWS) tile_rows = PIPELINE_TILE_ROWS;
+        int need = pass->halo;
+        long int count = tile_rows + 2 * need;
+        int current = 0;
+
+        //Loading the tile and its halo, wrapping around the top and bottom of the image.
+        for(long int i = 0; i < count; i++)
+        {
+            long int y = ((tile - need + i) % h + h) % h;
+            PPMPixel *row = buffer[0] + i * stride + pass->pad;
+            memcpy(row, param->image + y * w, w * sizeof(PPMPixel));
+            wrap_row_padding(row, w, pass->pad);
+        }
+
+        for(int k = pass->first; k < pass->first + pass->count; k++)
+        {
+            const struct stage *s = &param->pipeline->stages[k];
+            clock_gettime(CLOCK_MONOTONIC, &clock);
+
+            if(s->def->kind == STAGE_POINTWISE)
+            {
+                //Padding columns are transformed too, so they stay equal to the pixels they wrap around to.
+                for(long int i = 0; i < count; i++)
+                {
+                    s->def->point(s, buffer[current] + i * stride, stride);
+                }
+            }
+            else
+            {
+                int r = s->radius;
+                long int produced = count - 2 * r;
+                for(long int i = 0; i < produced; i++)
+                {
+                    for(int d = 0; d <= 2 * r; d++)
+                    {
+                        rows[d] = buffer[current] + (i + d) * stride + pass->pad;
+                    }
+                    PPMPixel *out = buffer[1 - current] + i * stride + pass->pad;
+                    s->def->row(s, rows, out, w);
+                    wrap_row_padding(out, w, pass->pad);
+                }
+                current = 1 - current;
+                need -= r;
+                count = produced;
+            }
+            param->stage_seconds[k] += seconds_since(&clock);
+        }
+
+        for(long int i = 0; i < tile_rows; i++)
+        {
+            memcpy(param->result + (tile + i) * w, buffer[current] + i * stride + pass->pad, w * sizeof(PPMPixel));
+        }
+    }
+
+    free(buffer[0]);
+    free(buffer[1]);
+    return NULL;
+}
+
+/* Append "name[:arg]" of stage s to text. */
+void format_stage(const struct stage *s, char *text, size_t size)
+{
+    size_t used = strlen(text);
+    if(s->def->default_arg || s->arg)
+        snprintf(text + used, size - used, "%s:%d", s->def->name, s->arg);
+    else
+        snprintf(text + used, size - used, "%s", s->def->name);
+}
+
+/* Run pipeline p over an image: plan it, run every pass (tiled passes band-parallel like apply_filters), and add the
+ elapsed time to *elapsedTime. With pipeline_schedule set, the chosen schedule and the time of every stage are
+ printed to stderr, labelled with label.
+ Return: result (filtered image)
+ */
+PPMPixel *run_pipeline(const struct pipeline *p, PPMPixel *image, unsigned long w, unsigned long h, double *elapsedTime, const char *label)
+{
+    struct pipeline_pass passes[MAX_STAGES];
+    double stage_seconds[MAX_STAGES] = { 0 };
+    double pass_seconds[MAX_STAGES] = { 0 };
+    int pass_count = plan_pipeline(p, passes);
+    struct timespec clock, pass_clock;
+    PPMPixel *input = image;
+    PPMPixel *output = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    for(int n = 0; n < pass_count; n++)
+    {
+        const struct pipeline_pass *pass = &passes[n];
+        output = (PPMPixel*)malloc(w * h * sizeof(PPMPixel));
+        clock_gettime(CLOCK_MONOTONIC, &pass_clock);
+
+        if(pass->buffered)
+        {
+            const struct stage *s = &p->stages[pass->first];
+            s->def->global(s, input, output, w, h);
+            stage_seconds[pass->first] += seconds_since(&pass_clock);
+        }
+        else
+        {
+            struct pipeline_parameter params[LAPLACIAN_THREADS];
+            pthread_t t[LAPLACIAN_THREADS];
+            int work = h / LAPLACIAN_THREADS;
+            for(int i = 0; i < LAPLACIAN_THREADS; i++)
+            {
+                memset(&params[i], 0, sizeof(params[i]));
+                params[i].pipeline = p;
+                params[i].pass = pass;
+                params[i].image = input;
+                params[i].result = output;
+                params[i].w = w;
+                params[i].h = h;
+                params[i].start = i * work;
+                //Making sure that the last thread take on the rest of the work
+                params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : work;
+                if(pthread_create(&t[i], NULL, run_pipeline_pass_threadfn, (void*)&params[i]) != 0)
+                {
+                    fprintf(stderr, "Unable to create thread %d\n", i);
+                }
+            }
+            for(int i = 0; i < LAPLACIAN_THREADS; i++)
+            {
+                pthread_join(t[i], NULL);
+                for(int k = 0; k < MAX_STAGES; k++) stage_seconds[k] += params[i].stage_seconds[k];
+            }
+        }
+        pass_seconds[n] = seconds_since(&pass_clock);
+
+        if(input != image) free(input);
+        input = output;
+    }
+    double elapsed = seconds_since(&clock);
+
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += elapsed;
+    pthread_mutex_unlock(&mutex_c);
+
+    if(pipeline_schedule)
+    {
+        pthread_mutex_lock(&mutex_schedule);
+        fprintf(stderr, "schedule for %s (%lux%lu): %d pass%s, %.4f s\n", label, w, h, pass_count, pass_count == 1 ? "" : "es", elapsed);
+        for(int n = 0; n < pass_count; n++)
+        {
+            const struct pipeline_pass *pass = &passes[n];
+            char stages[512] = "";
+            for(int k = pass->first; k < pass->first + pass->count; k++)
+            {
+                if(k > pass->first) strcat(stages, " -> ");
+                format_stage(&p->stages[k], stages, sizeof(stages));
+            }
+            if(pass->buffered)
+                fprintf(stderr, "  pass %d: buffered, %s  %.4f s\n", n + 1, stages, pass_seconds[n]);
+            else
+                fprintf(stderr, "  pass %d: tiled %d rows, halo %d, %s  %.4f s\n", n + 1, PIPELINE_TILE_ROWS, pass->halo, stages, pass_seconds[n]);
+            for(int k = pass->first; k < pass->first + pass->count; k++)
+            {
+                char name[64] = "";
+                format_stage(&p->stages[k], name, sizeof(name));
+                fprintf(stderr, "    %-16s %-9s %.4f s (summed over threads)\n", name, stage_kind_names[p->stages[k].def->kind], stage_seconds[k]);
+            }
+        }
+        pthread_mutex_unlock(&mutex_schedule);
+    }
+    return output;
+}
+
+/* User-defined convolution kernels.
+ A kernel is given at runtime as "WxH[/D]:c00,c01,...", integer coefficients in row-major order with an optional
+ divisor D, e.g. "3x3/16:1,2,1,2,4,2,1,2,1", or as @FILE holding the same text. Like the Laplacian it is placed on top
+ of the image with toroidal wraparound; each output value is floor((sum + D/2) / D) truncated to 0..255. Sums are
+ kept in an int, so no coefficient or divisor may exceed INT_MAX / (255 * W * H + 1) in magnitude.
+ Rows are filtered from a ring of padded source rows, so no tap ever needs a modulo: each padded row starts kw/2 pixels
+ left of column 0 and tap (dy, dx) of output byte i is byte i + 3*dx of ring row dy.
+ */
+#define MAX_KERNEL_SIZE 63
+
+struct kernel {
+    int w;                   //columns, odd
+    int h;                   //rows, odd
+    int divisor;
+    int coefficients[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE];   //row-major
+};
+
+/* Filters n bytes of one output row from the padded ring rows. */
+typedef void (*kernel_row_fn)(const unsigned char *const *rows, unsigned char *out, long int n);
+
+struct convolution_parameter {
+    PPMPixel *image;         //original image pixel data
+    PPMPixel *result;        //filtered image pixel data
+    const struct kernel *kernel;
+    kernel_row_fn jit;       //generated code for the kernel, NULL to use the generic loop only
+    unsigned long int w;     //width of image
+    unsigned long int h;     //height of image
+    unsigned long int start; //starting point of work
+    unsigned long int size;  //equal share of work (almost equal if odd)
+};
+
+struct kernel active_kernel;
+int kernel_enabled = 0;
+int jit_enabled = 1;
+
+/* Parse a kernel description into k.
+ Return: 0 on success, -1 with a message on stderr otherwise.
+ */
+int kernel_separator(char c)
+{
+    return c == ':' || c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int parse_kernel(const char *description, struct kernel *k)
+{
+    char *end;
+    long int w, h, divisor = 1;
+    w = strtol(description, &end, 10);
+    if(*end != 'x')
+    {
+        fprintf(stderr, "Kernel must start with its size, e.g. 3x3:\n");
+        return -1;
+    }
+    h = strtol(end + 1, &end, 10);
+    if(*end == '/')
+    {
+        divisor = strtol(end + 1, &end, 10);
+    }
+    if(w < 1 || h < 1 || w % 2 == 0 || h % 2 == 0 || w > MAX_KERNEL_SIZE || h > MAX_KERNEL_SIZE || divisor < 1)
+    {
+        fprintf(stderr, "Kernel size must be odd and at most %d, and its divisor positive\n", MAX_KERNEL_SIZE);
+        return -1;
+    }
+    //Every tap can add 255 * |coefficient| to the int sum, and rounding adds up to half the divisor.
+    long int limit = INT_MAX / (255 * w * h + 1);
+    if(divisor > limit)
+    {
+        fprintf(stderr, "Kernel divisor %ld is out of range, at most %ld for a %ldx%ld kernel\n", divisor, limit, w, h);
+        return -1;
+    }
+    k->w = w;
+    k->h = h;
+    k->divisor = divisor;
+
+    int count = k->w * k->h;
+    for(int i = 0; i < count; i++)
+    {
+        while(kernel_separator(*end)) end++;
+        char *next;
+        long int coefficient = strtol(end, &next, 10);
+        if(next == end)
+        {
+            fprintf(stderr, "Kernel needs %d coefficients, found %d\n", count, i);
+            return -1;
+        }
+        if(coefficient > limit || coefficient < -limit)
+        {
+            fprintf(stderr, "Kernel coefficient %d is out of range, at most %ld in magnitude for a %ldx%ld kernel\n", i + 1, limit, w, h);
+            return -1;
+        }
+        k->coefficients[i] = coefficient;
+        end = next;
+    }
+    while(kernel_separator(*end)) end++;
+    if(*end)
+    {
+        fprintf(stderr, "Kernel needs %d coefficients, found more\n", count);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a kernel from the command line, or from a file when it starts with '@'. */
+int load_kernel(const char *arg, struct kernel *k)
+{
+    if(arg[0] != '@')
+    {
+        return parse_kernel(arg, k);
+    }
+
+    FILE *fp = fopen(arg + 1, "rb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", arg + 1);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *description = malloc(length + 1);
+    size_t got = fread(description, 1, length, fp);
+    description[got] = '\0';
+    fclose(fp);
+
+    int status = parse_kernel(description, k);
+    free(description);
+    return status;
+}
+
+int floor_div(int value, int divisor)
+{
+    int q = value / divisor;
+    return (value % divisor != 0 && value < 0) ? q - 1 : q;
+}
+
+/* The generic inner loop: bytes from to n of one output row, one tap at a time over the whole span. */
+void convolve_row_generic(const struct kernel *k, const unsigned char *const *rows, unsigned char *out, long int from, long int n, int *acc)
+{
+    for(long int i = from; i < n; i++) acc[i] = k->divisor / 2;
+    for(int dy = 0; dy < k->h; dy++)
+    {
+        const unsigned char *row = rows[dy];
+        for(int dx = 0; dx < k->w; dx++)
+        {
+            int c = k->coefficients[dy * k->w + dx];
+            if(c == 0) continue;
+            const unsigned char *src = row + 3 * dx;
+            for(long int i = from; i < n; i++) acc[i] += c * src[i];
+        }
+    }
+    for(long int i = from; i < n; i++)
+    {
+        out[i] = clamp_pixel(k->divisor == 1 ? acc[i] : floor_div(acc[i], k->divisor));
+    }
+}
+
+/* This is the thread function for user-defined kernels. It filters rows start to start+size. The ring keeps the
+ kernel height worth of padded source rows, so moving to the next output row loads only one new row.
+ Bytes up to the last multiple of 16 go through the generated code when there is one, the rest through the generic loop.
+ */
+void *compute_convolution_threadfn(void *params)
+{
+    struct convolution_parameter *param = (struct convolution_parameter *) params;
+    const struct kernel *k = param->kernel;
+    long int w = param->w, h = param->h;
+    int rx = k->w / 2, ry = k->h / 2;
+    long int stride = w + 2 * rx;
+    long int n = 3 * w;
+    PPMPixel *ring = malloc(k->h * stride * sizeof(PPMPixel));
+    int *acc = malloc(n * sizeof(int));
+    const unsigned char *rows[MAX_KERNEL_SIZE];
+
+    for(long int y = param->start; y < (long int)(param->start + param->size); y++)
+    {
+        for(int dy = 0; dy < k->h; dy++)
+        {
+            long int source = y - ry + dy;
+            long int slot = (source % k->h + k->h) % k->h;
+            PPMPixel *row = ring + slot * stride + rx;
+            if(y == (long int)param->start || dy == k->h - 1)
+            {
+                memcpy(row, param->image + ((source % h + h) % h) * w, w * sizeof(PPMPixel));
+                wrap_row_padding(row, w, rx);
+            }
+            rows[dy] = (const unsigned char *)(row - rx);
+        }
+
+        unsigned char *out = (unsigned char *)(param->result + y * w);
+        long int done = 0;
+        if(param->jit)
+        {
+            done = n & ~15L;
+            if(done > 0) param->jit(rows, out, done);
+        }
+        convolve_row_generic(k, rows, out, done, n, acc);
+    }
+
+    free(ring);
+    free(acc);
+    return NULL;
+}
+
+#if defined(__x86_64__)
+/* Runtime code generation for kernels (x86-64, SSE2, System V calling convention).
+ The generated function has the kernel_row_fn signature and handles 16 bytes per iteration: for every non-zero tap it
+ loads 16 source bytes, widens them to two vectors of eight 16-bit lanes, and adds, subtracts or multiplies-and-adds
+ them into two accumulators. Coefficients are materialised from immediates once, in the prologue, and ±1 taps need no
+ multiply at all. packuswb saturates the sums to 0..255, which is exactly the truncation the generic path does.
+ Kernels whose sums could overflow 16 bits, or whose divisor is not a power of two, stay on the generic path.
+ */
+#define JIT_CODE_SIZE 65536
+#define JIT_CACHE_SIZE 16
+
+struct jit_buffer {
+    unsigned char *code;
+    size_t length;
+    int overflow;
+};
+
+struct jit_cache_entry {
+    struct kernel kernel;
+    kernel_row_fn fn;
+};
+
+struct jit_cache_entry jit_cache[JIT_CACHE_SIZE];
+int jit_cache_count = 0;
+pthread_mutex_t mutex_jit = PTHREAD_MUTEX_INITIALIZER;
+
+void emit_byte(struct jit_buffer *b, unsigned char byte)
+{
+    if(b->length < JIT_CODE_SIZE) b->code[b->length++] = byte;
+    else b->overflow = 1;
+}
+
+void emit_int32(struct jit_buffer *b, int value)
+{
+    for(int i = 0; i < 4; i++) emit_byte(b, (unsigned int)value >> (8 * i));
+}
+
+/* prefix [REX] 0F op modrm, for an xmm register to register form. */
+void emit_sse_reg(struct jit_buffer *b, unsigned char prefix, unsigned char op, int reg, int rm)
+{
+    emit_byte(b, prefix);
+    if(reg >= 8 || rm >= 8) emit_byte(b, 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    emit_byte(b, 0x0F);
+    emit_byte(b, op);
+    emit_byte(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* movdqu xmm, [r8 + rcx + disp32] */
+void emit_load_tap(struct jit_buffer *b, int xmm, int disp)
+{
+    emit_byte(b, 0xF3);
+    emit_byte(b, 0x41 | (xmm >= 8 ? 4 : 0));
+    emit_byte(b, 0x0F);
+    emit_byte(b, 0x6F);
+    emit_byte(b, 0x80 | (xmm & 7) << 3 | 4);
+    emit_byte(b, 0x08);                      //SIB: index rcx, base r8
+    emit_int32(b, disp);
+}
+
+/* Broadcast a 16-bit immediate into all lanes of xmm: mov eax, imm32; movd xmm, eax; pshuflw xmm, xmm, 0; punpcklqdq xmm, xmm */
+void emit_broadcast(struct jit_buffer *b, int xmm, int value)
+{
+    emit_byte(b, 0xB8);
+    emit_int32(b, value & 0xFFFF);
+    emit_sse_reg(b, 0x66, 0x6E, xmm, 0);
+    emit_sse_reg(b, 0xF2, 0x70, xmm, xmm);
+    emit_byte(b, 0x00);
+    emit_sse_reg(b, 0x66, 0x6C, xmm, xmm);
+}
+
+/* Return: shift s with 1 << s == divisor, or -1 if the divisor is not a power of two. */
+int divisor_shift(int divisor)
+{
+    for(int s = 0; s < 16; s++)
+    {
+        if(divisor == 1 << s) return s;
+    }
+    return -1;
+}
+
+/* Generate code for kernel k into executable memory.
+ Return: the generated function, or NULL if the kernel is not suitable for the 16-bit code.
+ */
+kernel_row_fn jit_compile_kernel(const struct kernel *k)
+{
+    enum { ZERO = 0, SRC_LO = 1, ACC_LO = 2, SRC_HI = 3, ACC_HI = 4, SCRATCH = 5, ROUNDING = 6, FIRST_CONSTANT = 8 };
+    int shift = divisor_shift(k->divisor);
+    long int magnitude = k->divisor / 2;
+    int constants[8];
+    int constant_count = 0;
+
+    for(int i = 0; i < k->w * k->h; i++)
+    {
+        magnitude += abs(k->coefficients[i]);
+    }
+    if(shift < 0 || magnitude * 255 > 32767)
+    {
+        return NULL;
+    }
+
+    struct jit_buffer b = { 0 };
+    b.code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(b.code == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    //Prologue: zero register, rounding constant, multiplier constants, loop index.
+    emit_sse_reg(&b, 0x66, 0xEF, ZERO, ZERO);
+    emit_broadcast(&b, ROUNDING, k->divisor / 2);
+    for(int i = 0; i < k->w * k->h; i++)
+    {
+        int c = k->coefficients[i], known = 0;
+        if(c == 0 || c == 1 || c == -1) continue;
+        for(int j = 0; j < constant_count; j++) known |= constants[j] == c;
+        if(!known && constant_count < 8)
+        {
+            emit_broadcast(&b, FIRST_CONSTANT + constant_count, c);
+            constants[constant_count++] = c;
+        }
+    }
+    emit_byte(&b, 0x31); emit_byte(&b, 0xC9);             //xor ecx, ecx
+
+    size_t loop = b.length;
+    emit_sse_reg(&b, 0x66, 0x6F, ACC_LO, ROUNDING);         //movdqa acc, rounding
+    emit_sse_reg(&b, 0x66, 0x6F, ACC_HI, ROUNDING);
+    for(int dy = 0; dy < k->h; dy++)
+    {
+        int row_loaded = 0;
+        for(int dx = 0; dx < k->w; dx++)
+        {
+            int c = k->coefficients[dy * k->w + dx];
+            if(c == 0) continue;
+            if(!row_loaded)
+            {
+                //mov r8, [rdi + 8*dy]
+                emit_byte(&b, 0x4C); emit_byte(&b, 0x8B); emit_byte(&b, 0x87);
+                emit_int32(&b, 8 * dy);
+                row_loaded = 1;
+            }
+            emit_load_tap(&b, SRC_LO, 3 * dx);
+            emit_sse_reg(&b, 0x66, 0x6F, SRC_HI, SRC_LO);     //movdqa
+            emit_sse_reg(&b, 0x66, 0x60, SRC_LO, ZERO);       //punpcklbw
+            emit_sse_reg(&b, 0x66, 0x68, SRC_HI, ZERO);       //punpckhbw
+            if(c == 1 || c == -1)
+            {
+                unsigned char op = c == 1 ? 0xFD : 0xF9;      //paddw / psubw
+                emit_sse_reg(&b, 0x66, op, ACC_LO, SRC_LO);
+                emit_sse_reg(&b, 0x66, op, ACC_HI, SRC_HI);
+                continue;
+            }
+            int multiplier = SCRATCH;
+            for(int j = 0; j < constant_count; j++)
+            {
+                if(constants[j] == c) multiplier = FIRST_CONSTANT + j;
+            }
+            if(multiplier == SCRATCH) emit_broadcast(&b, SCRATCH, c);
+            emit_sse_reg(&b, 0x66, 0xD5, SRC_LO, multiplier);   //pmullw
+            emit_sse_reg(&b, 0x66, 0xD5, SRC_HI, multiplier);
+            emit_sse_reg(&b, 0x66, 0xFD, ACC_LO, SRC_LO);       //paddw
+            emit_sse_reg(&b, 0x66, 0xFD, ACC_HI, SRC_HI);
+        }
+    }
+    if(shift > 0)
+    {
+        emit_sse_reg(&b, 0x66, 0x71, 4, ACC_LO); emit_byte(&b, shift);   //psraw acc, shift
+        emit_sse_reg(&b, 0x66, 0x71, 4, ACC_HI); emit_byte(&b, shift);
+    }
+    emit_sse_reg(&b, 0x66, 0x67, ACC_LO, ACC_HI);           //packuswb
+    //movdqu [rsi + rcx], acc
+    emit_byte(&b, 0xF3); emit_byte(&b, 0x0F); emit_byte(&b, 0x7F);
+    emit_byte(&b, 0x04 | ACC_LO << 3); emit_byte(&b, 0x0E);
+    emit_byte(&b, 0x48); emit_byte(&b, 0x83); emit_byte(&b, 0xC1); emit_byte(&b, 16);   //add rcx, 16
+    emit_byte(&b, 0x48); emit_byte(&b, 0x39); emit_byte(&b, 0xD1);                     //cmp rcx, rdx
+    emit_byte(&b, 0x0F); emit_byte(&b, 0x82);                                          //jb loop
+    emit_int32(&b, (int)loop - (int)(b.length + 4));
+    emit_byte(&b, 0xC3);                                                               //ret
+
+    if(b.overflow || mprotect(b.code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(b.code, JIT_CODE_SIZE);
+        return NULL;
+    }
+    return (kernel_row_fn)(void *)b.code;
+}
+
+/* Return: generated code for k, compiling it on first use. Kernels that cannot be compiled are cached as NULL. */
+kernel_row_fn jit_lookup_kernel(const struct kernel *k)
+{
+    kernel_row_fn fn = NULL;
+    size_t used = offsetof(struct kernel, coefficients) + k->w * k->h * sizeof(int);
+
+    pthread_mutex_lock(&mutex_jit);
+    for(int i = 0; i < jit_cache_count; i++)
+    {
+        if(memcmp(&jit_cache[i].kernel, k, used) == 0)
+        {
+            fn = jit_cache[i].fn;
+            pthread_mutex_unlock(&mutex_jit);
+            return fn;
+        }
+    }
+    fn = jit_compile_kernel(k);
+    if(jit_cache_count < JIT_CACHE_SIZE)
+    {
+        memcpy(&jit_cache[jit_cache_count].kernel, k, used);
+        jit_cache[jit_cache_count].fn = fn;
+        jit_cache_count++;
+    }
+    pthread_mutex_unlock(&mutex_jit);
+    return fn;
+}
+#else
+kernel_row_fn jit_lookup_kernel(const struct kernel *k)
+{
+    return NULL;
+}
+#endif
+
+/* FFT convolution for large kernels.
+ Direct convolution costs kw*kh taps per pixel; above fft_crossover (measured by --bench) kernels are applied with
+ overlap-save instead. The image is cut into N x N tiles, N a power of two, whose valid parts are
+ (N-kw+1) x (N-kh+1) output pixels; the input of a tile is fetched with the same toroidal wraparound as the direct
+ path, so the circular convolution inside a tile only ever wraps into the discarded overlap. The three channels are
+ transformed as two complex tiles, r + i*g and b, which is the real-input FFT trick: the kernel is real, so the real
+ and imaginary parts of the product stay separate. Tiles are handed out round-robin to LAPLACIAN_THREADS threads.
+ */
+#define DEFAULT_FFT_CROSSOVER 11
+#define FFT_MIN_TILE 32
+#define FFT_MAX_TILE 512
+
+int fft_crossover = DEFAULT_FFT_CROSSOVER;   //kernels at least this wide or tall use the FFT path, 0 disables it
+
+enum kernel_method {
+    KERNEL_AUTO,             //FFT above fft_crossover, generated code when enabled, generic loop otherwise
+    KERNEL_GENERIC,
+    KERNEL_JIT,              //generated code where the kernel allows it, generic loop otherwise
+    KERNEL_FFT
+};
+
+struct fft_plan {
+    int n;
+    double *cos_table;       //cos(2*pi*k/n) for k < n/2
+    double *sin_table;
+    int *bitrev;
+};
+
+struct fft_parameter {
+    PPMPixel *image;         //original image pixel data
+    PPMPixel *result;        //filtered image pixel data
+    const struct kernel *kernel;
+    const struct fft_plan *plan;
+    const double *spectrum_re;  //transform of the flipped, zero padded kernel
+    const double *spectrum_im;
+    unsigned long int w;
+    unsigned long int h;
+    int tiles_x;
+    int tiles_y;
+    int thread;              //this thread takes tiles thread, thread+LAPLACIAN_THREADS, ...
+};
+
+void fft_plan_init(struct fft_plan *p, int n)
+{
+    int bits = 0;
+    while((1 << bits) < n) bits++;
+    p->n = n;
+    p->cos_table = malloc(n / 2 * sizeof(double));
+    p->sin_table = malloc(n / 2 * sizeof(double));
+    p->bitrev = malloc(n * sizeof(int));
+    for(int k = 0; k < n / 2; k++)
+    {
+        p->cos_table[k] = cos(2 * M_PI * k / n);
+        p->sin_table[k] = sin(2 * M_PI * k / n);
+    }
+    for(int i = 0; i < n; i++)
+    {
+        int r = 0;
+        for(int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+        p->bitrev[i] = r;
+    }
+}
+
+void fft_plan_free(struct fft_plan *p)
+{
+    free(p->cos_table);
+    free(p->sin_table);
+    free(p->bitrev);
+}
+
+/* In-place iterative radix-2 FFT of n complex values. The inverse is unscaled. */
+void fft_1d(double *re, double *im, const struct fft_plan *p, int inverse)
+{
+    int n = p->n;
+    for(int i = 0; i < n; i++)
+    {
+        int j = p->bitrev[i];
+        if(j > i)
+        {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for(int length = 2; length <= n; length <<= 1)
+    {
+        int half = length / 2, step = n / length;
+        for(int i = 0; i < n; i += length)
+        {
+            for(int k = 0; k < half; k++)
+            {
+                double wr = p->cos_table[k * step];
+                double wi = inverse ? p->sin_table[k * step] : -p->sin_table[k * step];
+                int a = i + k, b = a + half;
+                double tr = re[b] * wr - im[b] * wi;
+                double ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+/* In-place 2D FFT of an n x n tile: every row, then every column through the scratch arrays (2*n doubles). */
+void fft_2d(double *re, double *im, const struct fft_plan *p, int inverse, double *scratch)
+{
+    int n = p->n;
+    double *column_re = scratch, *column_im = scratch + n;
+    for(int y = 0; y < n; y++)
+    {
+        fft_1d(re + y * n, im + y * n, p, inverse);
+    }
+    for(int x = 0; x < n; x++)
+    {
+        for(int y = 0; y < n; y++)
+        {
+            column_re[y] = re[y * n + x];
+            column_im[y] = im[y * n + x];
+        }
+        fft_1d(column_re, column_im, p, inverse);
+        for(int y = 0; y < n; y++)
+        {
+            re[y * n + x] = column_re[y];
+            im[y * n + x] = column_im[y];
+        }
+    }
+}
+
+/* Return: tile size for kernel k, the smallest power of two at least four times the kernel. */
+int fft_tile_size(const struct kernel *k)
+{
+    int largest = k->w > k->h ? k->w : k->h;
+    int n = FFT_MIN_TILE;
+    while(n < 4 * largest && n < FFT_MAX_TILE) n <<= 1;
+    return n;
+}
+
+/* This is the thread function of the FFT path. For each of its tiles it gathers the wrapped input, transforms it,
+ multiplies by the kernel spectrum, transforms back and writes the valid part, rounded and truncated like the direct path.
+ */
+void *compute_fft_convolution_threadfn(void *params)
+{
+    struct fft_parameter *param = (struct fft_parameter *) params;
+    const struct kernel *k = param->kernel;
+    int n = param->plan->n;
+    long int w = param->w, h = param->h;
+    int valid_x = n - k->w + 1, valid_y = n - k->h + 1;
+    double scale = 1.0 / ((double)n * n);
+    double *rg_re = malloc(n * n * sizeof(double));
+    double *rg_im = malloc(n * n * sizeof(double));
+    double *b_re = malloc(n * n * sizeof(double));
+    double *b_im = malloc(n * n * sizeof(double));
+    double *scratch = malloc(2 * n * sizeof(double));
+    long int *columns = malloc(n * sizeof(long int));
+
+    for(int tile = param->thread; tile < param->tiles_x * param->tiles_y; tile += LAPLACIAN_THREADS)
+    {
+        long int ox = (long int)(tile % param->tiles_x) * valid_x;
+        long int oy = (long int)(tile / param->tiles_x) * valid_y;
+
+        for(int i = 0; i < n; i++)
+        {
+            columns[i] = ((ox - k->w / 2 + i) % w + w) % w;
+        }
+        for(int j = 0; j < n; j++)
+        {
+            const PPMPixel *row = param->image + ((oy - k->h / 2 + j) % h + h) % h * w;
+            for(int i = 0; i < n; i++)
+            {
+                const PPMPixel *p = &row[columns[i]];
+                rg_re[j * n + i] = p->r;
+                rg_im[j * n + i] = p->g;
+                b_re[j * n + i] = p->b;
+                b_im[j * n + i] = 0;
+            }
+        }
+
+        fft_2d(rg_re, rg_im, param->plan, 0, scratch);
+        fft_2d(b_re, b_im, param->plan, 0, scratch);
+        for(int i = 0; i < n * n; i++)
+        {
+            double sr = param->spectrum_re[i], si = param->spectrum_im[i];
+            double re = rg_re[i] * sr - rg_im[i] * si;
+            rg_im[i] = rg_re[i] * si + rg_im[i] * sr;
+            rg_re[i] = re;
+            re = b_re[i] * sr - b_im[i] * si;
+            b_im[i] = b_re[i] * si + b_im[i] * sr;
+            b_re[i] = re;
+        }
+        fft_2d(rg_re, rg_im, param->plan, 1, scratch);
+        fft_2d(b_re, b_im, param->plan, 1, scratch);
+
+        for(int j = 0; j < valid_y && oy + j < h; j++)
+        {
+            PPMPixel *out = param->result + (oy + j) * w;
+            for(int i = 0; i < valid_x && ox + i < w; i++)
+            {
+                //The sums are integers, so rounding recovers exactly what the direct path computes.
+                int sum[3] = { (int)lround(rg_re[j * n + i] * scale), (int)lround(rg_im[j * n + i] * scale), (int)lround(b_re[j * n + i] * scale) };
+                unsigned char value[3];
+                for(int c = 0; c < 3; c++)
+                {
+                    value[c] = clamp_pixel(floor_div(sum[c] + k->divisor / 2, k->divisor));
+                }
+                out[ox + i].r = value[0];
+                out[ox + i].g = value[1];
+                out[ox + i].b = value[2];
+            }
+        }
+    }
+
+    free(rg_re);
+    free(rg_im);
+    free(b_re);
+    free(b_im);
+    free(scratch);
+    free(columns);
+    return NULL;
+}
+
+/* Apply kernel k with overlap-save FFT convolution into result, using threads. */
+void apply_kernel_fft(const struct kernel *k, PPMPixel *image, PPMPixel *result, unsigned long w, unsigned long h)
+{
+    struct fft_plan plan;
+    int n = fft_tile_size(k);
+    double *spectrum_re = calloc(n * n, sizeof(double));
+    double *spectrum_im = calloc(n * n, sizeof(double));
+    double *scratch = malloc(2 * n * sizeof(double));
+    struct fft_parameter params[LAPLACIAN_THREADS];
+    pthread_t t[LAPLACIAN_THREADS];
+
+    fft_plan_init(&plan, n);
+
+    //The filter is correlated with the image, so the kernel goes in flipped: tap (dx, dy) at (-dx, -dy) mod n.
+    for(int dy = 0; dy < k->h; dy++)
+    {
+        for(int dx = 0; dx < k->w; dx++)
+        {
+            spectrum_re[((n - dy) % n) * n + (n - dx) % n] = k->coefficients[dy * k->w + dx];
+        }
+    }
+    fft_2d(spectrum_re, spectrum_im, &plan, 0, scratch);
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].image = image;
+        params[i].result = result;
+        params[i].kernel = k;
+        params[i].plan = &plan;
+        params[i].spectrum_re = spectrum_re;
+        params[i].spectrum_im = spectrum_im;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].tiles_x = (w + (n - k->w)) / (n - k->w + 1);
+        params[i].tiles_y = (h + (n - k->h)) / (n - k->h + 1);
+        params[i].thread = i;
+        if(pthread_create(&t[i], NULL, compute_fft_convolution_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(t[i], NULL);
+    }
+
+    fft_plan_free(&plan);
+    free(spectrum_re);
+    free(spectrum_im);
+    free(scratch);
+}
+
+/* Apply a user-defined kernel to an image using threads, split into bands like apply_filters.
+ method selects the direct loop, the generated code or the FFT path; KERNEL_AUTO picks by kernel size.
+ Return: result (filtered image)
+ */
+PPMPixel *apply_kernel(const struct kernel *k, enum kernel_method method, PPMPixel *image, unsigned long w, unsigned long h, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    PPMPixel *result = (PPMPixel*)malloc(w * h * sizeof(PPMPixel));
+    struct convolution_parameter params[LAPLACIAN_THREADS];
+    pthread_t t[LAPLACIAN_THREADS];
+    int work = h / LAPLACIAN_THREADS;
+    int largest = k->w > k->h ? k->w : k->h;
+    kernel_row_fn jit = NULL;
+
+    if(method == KERNEL_AUTO)
+    {
+        if(fft_crossover > 0 && largest >= fft_crossover) method = KERNEL_FFT;
+        else method = jit_enabled ? KERNEL_JIT : KERNEL_GENERIC;
+    }
+    if(method == KERNEL_JIT)
+    {
+        jit = jit_lookup_kernel(k);
+    }
+
+    if(method == KERNEL_FFT)
+    {
+        apply_kernel_fft(k, image, result, w, h);
+    }
+    else
+    {
+        for(int i = 0; i < LAPLACIAN_THREADS; i++)
+        {
+            params[i].image = image;
+            params[i].result = result;
+            params[i].kernel = k;
+            params[i].jit = jit;
+            params[i].w = w;
+            params[i].h = h;
+            params[i].start = i * work;
+            //Making sure that the last thread take on the rest of the work
+            params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : work;
+            if(pthread_create(&t[i], NULL, compute_convolution_threadfn, (void*)&params[i]) != 0)
+            {
+                fprintf(stderr, "Unable to create thread %d\n", i);
+            }
+        }
+        for(int i = 0; i < LAPLACIAN_THREADS; i++)
+        {
+            pthread_join(t[i], NULL);
+        }
+    }
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+    return result;
+}
+
+/* Tiled in-memory layout.
+ With --layout=tiled the image is stored as LAYOUT_TILE x LAYOUT_TILE tiles, each padded with a one pixel halo copied
+ from its (wrapped) neighbours, and the tiles are laid out in Morton (Z) order of their grid position. The vertical
+ neighbours of a pixel are then LAYOUT_TILE+2 pixels away instead of a whole image row, tiles that are close on the
+ grid are close in memory, and the filter needs no wraparound arithmetic at all.
+ */
+#define LAYOUT_TILE 32
+#define LAYOUT_STRIDE (LAYOUT_TILE + 2)      //pixels per padded tile row
+
+enum image_layout { LAYOUT_SCANLINE, LAYOUT_TILED };
+enum image_layout image_layout = LAYOUT_SCANLINE;
+
+struct tiled_image {
+    PPMPixel *data;          //padded tiles, LAYOUT_STRIDE * LAYOUT_STRIDE pixels each, in Morton order
+    unsigned long int w;
+    unsigned long int h;
+    int tiles_x;
+    int tiles_y;
+    int *order;              //grid index (ty * tiles_x + tx) of the tile stored at each position
+};
+
+enum tile_phase { TILE_FROM_SCANLINE, TILE_FILTER, TILE_TO_SCANLINE };
+
+struct tile_parameter {
+    enum tile_phase phase;
+    PPMPixel *image;         //scanline image pixel data
+    struct tiled_image *tiled;
+    PPMPixel *tiled_result;  //unpadded LAYOUT_TILE x LAYOUT_TILE result tiles, same order as tiled->data
+    int first;               //tiles first to last-1 in storage order
+    int last;
+};
+
+unsigned int morton_code(unsigned int x, unsigned int y)
+{
+    unsigned int code = 0;
+    for(int b = 0; b < 16; b++)
+    {
+        code |= ((x >> b) & 1) << (2 * b) | ((y >> b) & 1) << (2 * b + 1);
+    }
+    return code;
+}
+
+int compare_keys(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+struct tiled_image *tiled_image_create(unsigned long int w, unsigned long int h)
+{
+    struct tiled_image *t = malloc(sizeof(struct tiled_image));
+    int count;
+    t->w = w;
+    t->h = h;
+    t->tiles_x = (w + LAYOUT_TILE - 1) / LAYOUT_TILE;
+    t->tiles_y = (h + LAYOUT_TILE - 1) / LAYOUT_TILE;
+    count = t->tiles_x * t->tiles_y;
+    t->data = malloc((size_t)count * LAYOUT_STRIDE * LAYOUT_STRIDE * sizeof(PPMPixel));
+    t->order = malloc(count * sizeof(int));
+
+    //Sorting the grid positions by Morton code: code in the high half, grid index in the low half of each key.
+    unsigned long long *keys = malloc(count * sizeof(unsigned long long));
+    for(int i = 0; i < count; i++)
+    {
+        keys[i] = (unsigned long long)morton_code(i % t->tiles_x, i / t->tiles_x) << 32 | (unsigned int)i;
+    }
+    qsort(keys, count, sizeof(unsigned long long), compare_keys);
+    for(int i = 0; i < count; i++)
+    {
+        t->order[i] = (int)(keys[i] & 0xFFFFFFFFu);
+    }
+    free(keys);
+    return t;
+}
+
+void tiled_image_free(struct tiled_image *t)
+{
+    free(t->data);
+    free(t->order);
+    free(t);
+}
+
+/* Copy tile number slot from the scanline image, halo included. Interior rows are one memcpy each. */
+void tile_from_scanline(struct tiled_image *t, const PPMPixel *image, int slot)
+{
+    long int w = t->w, h = t->h;
+    long int x0 = (long int)(t->order[slot] % t->tiles_x) * LAYOUT_TILE - 1;
+    long int y0 = (long int)(t->order[slot] / t->tiles_x) * LAYOUT_TILE - 1;
+    PPMPixel *tile = t->data + (size_t)slot * LAYOUT_STRIDE * LAYOUT_STRIDE;
+
+    for(int r = 0; r < LAYOUT_STRIDE; r++)
+    {
+        const PPMPixel *row = image + ((y0 + r) % h + h) % h * w;
+        PPMPixel *dest = tile + r * LAYOUT_STRIDE;
+        if(x0 >= 0 && x0 + LAYOUT_STRIDE <= w)
+        {
+            memcpy(dest, row + x0, LAYOUT_STRIDE * sizeof(PPMPixel));
+        }
+        else
+        {
+            for(int c = 0; c < LAYOUT_STRIDE; c++) dest[c] = row[((x0 + c) % w + w) % w];
+        }
+    }
+}
+
+/* Copy result tile number slot back into scanline order, clipped to the image. */
+void tile_to_scanline(struct tiled_image *t, const PPMPixel *tiled_result, PPMPixel *image, int slot)
+{
+    unsigned long int x0 = (unsigned long int)(t->order[slot] % t->tiles_x) * LAYOUT_TILE;
+    unsigned long int y0 = (unsigned long int)(t->order[slot] / t->tiles_x) * LAYOUT_TILE;
+    unsigned long int columns = t->w - x0 < LAYOUT_TILE ? t->w - x0 : LAYOUT_TILE;
+    const PPMPixel *tile = tiled_result + (size_t)slot * LAYOUT_TILE * LAYOUT_TILE;
+
+    for(unsigned long int r = 0; r < LAYOUT_TILE && y0 + r < t->h; r++)
+    {
+        memcpy(image + (y0 + r) * t->w + x0, tile + r * LAYOUT_TILE, columns * sizeof(PPMPixel));
+    }
+}
+
+/* Laplacian of one padded tile. The halo makes every neighbour a fixed offset, so each output row is a single loop
+ over its bytes that the compiler can vectorise.
+ */
+void tile_laplacian(const PPMPixel *tile, PPMPixel *result)
+{
+    const int row = 3 * LAYOUT_STRIDE;
+    for(int r = 0; r < LAYOUT_TILE; r++)
+    {
+        const unsigned char *center = (const unsigned char *)(tile + (r + 1) * LAYOUT_STRIDE + 1);
+        unsigned char *out = (unsigned char *)(result + r * LAYOUT_TILE);
+        for(int i = 0; i < 3 * LAYOUT_TILE; i++)
+        {
+            int sum = 8 * center[i] - center[i - 3] - center[i + 3]
+                    - center[i - row - 3] - center[i - row] - center[i - row + 3]
+                    - center[i + row - 3] - center[i + row] - center[i + row + 3];
+            out[i] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+        }
+    }
+}
+
+void *tile_phase_threadfn(void *params)
+{
+    struct tile_parameter *param = (struct tile_parameter *) params;
+    for(int slot = param->first; slot < param->last; slot++)
+    {
+        switch(param->phase)
+        {
+            case TILE_FROM_SCANLINE:
+                tile_from_scanline(param->tiled, param->image, slot);
+                break;
+            case TILE_FILTER:
+                tile_laplacian(param->tiled->data + (size_t)slot * LAYOUT_STRIDE * LAYOUT_STRIDE, param->tiled_result + (size_t)slot * LAYOUT_TILE * LAYOUT_TILE);
+                break;
+            case TILE_TO_SCANLINE:
+                tile_to_scanline(param->tiled, param->tiled_result, param->image, slot);
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* Run one phase over all tiles, each thread taking an equal run of tiles in storage order. */
+void run_tile_phase(enum tile_phase phase, PPMPixel *image, struct tiled_image *t, PPMPixel *tiled_result)
+{
+    struct tile_parameter params[LAPLACIAN_THREADS];
+    pthread_t threads[LAPLACIAN_THREADS];
+    int count = t->tiles_x * t->tiles_y;
+    int work = count / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = phase;
+        params[i].image = image;
+        params[i].tiled = t;
+        params[i].tiled_result = tiled_result;
+        params[i].first = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].last = i == LAPLACIAN_THREADS - 1 ? count : (i + 1) * work;
+        if(pthread_create(&threads[i], NULL, tile_phase_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Apply the Laplacian filter through the tiled layout: convert, filter tile by tile, convert back.
+ The time of the three phases is added to *elapsedTime; *filterTime, if not NULL, gets the filter phase alone.
+ Return: result (filtered image, scanline order)
+ */
+PPMPixel *apply_filters_tiled(PPMPixel *image, unsigned long w, unsigned long h, double *elapsedTime, double *filterTime)
+{
+    struct timespec clock, filter_clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+
+    struct tiled_image *t = tiled_image_create(w, h);
+    PPMPixel *tiled_result = malloc((size_t)t->tiles_x * t->tiles_y * LAYOUT_TILE * LAYOUT_TILE * sizeof(PPMPixel));
+    PPMPixel *result = malloc(w * h * sizeof(PPMPixel));
+
+    run_tile_phase(TILE_FROM_SCANLINE, image, t, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &filter_clock);
+    run_tile_phase(TILE_FILTER, NULL, t, tiled_result);
+    if(filterTime) *filterTime += seconds_since(&filter_clock);
+    run_tile_phase(TILE_TO_SCANLINE, result, t, tiled_result);
+
+    free(tiled_result);
+    tiled_image_free(t);
+
+    double elapsed = seconds_since(&clock);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += elapsed;
+    pthread_mutex_unlock(&mutex_c);
+    return result;
+}
+
+/* Benchmark harness.
+ Filters a synthetic image with the static Laplacian of compute_laplacian_threadfn, and with the same kernel given at
+ runtime through the generic loop and through the generated code, and reports megapixels per second of each.
+ Filters a synthetic document page with and without flat-region skipping.
+ Compares the scanline and the tiled layout over a range of image sizes.
+ Then sweeps square kernel sizes on a smaller image, timing the direct path against the FFT path, and reports the
+ size at which the FFT starts winning: the value to pass to --fft-crossover on this machine.
+ */
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_RUNS 5
+#define BENCH_SWEEP_SIZE 512         //square image used for the kernel size sweep
+#define BENCH_SWEEP_LARGEST 41
+
+PPMPixel *bench_image(unsigned long int w, unsigned long int h)
+{
+    PPMPixel *image = malloc(w * h * sizeof(PPMPixel));
+    unsigned int seed = 12345;
+    for(unsigned long int i = 0; i < w * h; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        image[i].r = seed >> 16;
+        image[i].g = seed >> 8;
+        image[i].b = (seed >> 24) ^ (i & 0xFF);
+    }
+    return image;
+}
+
+/* A synthetic scanned page: white paper with lines of dark glyph-sized blocks, mostly uniform. */
+PPMPixel *bench_document_image(unsigned long int w, unsigned long int h)
+{
+    PPMPixel *image = malloc(w * h * sizeof(PPMPixel));
+    unsigned int seed = 4321;
+    memset(image, 255, w * h * sizeof(PPMPixel));
+    for(unsigned long int line = 100; line + 12 < h - 100; line += 48)
+    {
+        for(unsigned long int x = 160; x + 8 < w - 160; x += 9)
+        {
+            seed = seed * 1103515245 + 12345;
+            if((seed >> 16) % 6 == 0) continue;      //space between words
+            for(unsigned long int y = line; y < line + 12; y++)
+            {
+                for(unsigned long int i = x; i < x + 6; i++)
+                {
+                    if((seed >> (8 + (y + i) % 16)) & 1) image[y * w + i].r = image[y * w + i].g = image[y * w + i].b = 20;
+                }
+            }
+        }
+    }
+    return image;
+}
+
+void bench_report(const char *name, double seconds, unsigned long int w, unsigned long int h, int runs)
+{
+    printf("  %-34s %9.4f s  %9.1f Mpixel/s\n", name, seconds / runs, (double)w * h * runs / seconds / 1e6);
+}
+
+int run_benchmarks(void)
+{
+    unsigned long int w = BENCH_WIDTH, h = BENCH_HEIGHT;
+    PPMPixel *image = bench_image(w, h);
+    struct kernel laplacian = { 3, 3, 1, { -1, -1, -1, -1, 8, -1, -1, -1, -1 } };
+    const struct kernel *custom = kernel_enabled ? &active_kernel : &laplacian;
+    double seconds;
+    PPMPixel *reference, *result;
+
+    printf("benchmark: %lux%lu, %d threads, %d runs\n", w, h, LAPLACIAN_THREADS, BENCH_RUNS);
+
+    seconds = 0;
+    for(int run = 0; run < BENCH_RUNS; run++)
+    {
+        reference = apply_filters(image, w, h, &seconds);
+        if(run < BENCH_RUNS - 1) free(reference);
+    }
+    bench_report("static compute_laplacian_threadfn", seconds, w, h, BENCH_RUNS);
+    if(kernel_enabled)
+    {
+        free(reference);
+        reference = apply_kernel(custom, KERNEL_GENERIC, image, w, h, &seconds);
+    }
+
+    seconds = 0;
+    for(int run = 0; run < BENCH_RUNS; run++)
+    {
+        result = apply_kernel(custom, KERNEL_GENERIC, image, w, h, &seconds);
+        free(result);
+    }
+    bench_report("runtime kernel, generic loop", seconds, w, h, BENCH_RUNS);
+
+    if(!jit_lookup_kernel(custom))
+    {
+        printf("  runtime kernel, generated code     not available for this kernel\n");
+    }
+    else
+    {
+        seconds = 0;
+        for(int run = 0; run < BENCH_RUNS; run++)
+        {
+            result = apply_kernel(custom, KERNEL_JIT, image, w, h, &seconds);
+            if(run < BENCH_RUNS - 1) free(result);
+        }
+        bench_report("runtime kernel, generated code", seconds, w, h, BENCH_RUNS);
+        if(memcmp(result, reference, w * h * sizeof(PPMPixel)) != 0)
+        {
+            printf("  generated code output differs from the reference\n");
+        }
+        free(result);
+    }
+
+    free(reference);
+    free(image);
+
+    //Flat-region skipping on a mostly uniform page.
+    image = bench_document_image(w, h);
+    int skip = flat_skip_enabled;
+    double skip_seconds[2] = { 0, 0 };
+    struct filter_outputs out = { 0 };
+    out.laplacian = malloc(w * h * sizeof(PPMPixel));
+    out.threshold = threshold_value;
+    for(flat_skip_enabled = 0; flat_skip_enabled <= 1; flat_skip_enabled++)
+    {
+        for(int run = 0; run < BENCH_RUNS; run++)
+        {
+            apply_fused_filters(image, w, h, &out, &skip_seconds[flat_skip_enabled]);
+        }
+    }
+    flat_skip_enabled = skip;
+    printf("synthetic document, %.1f%% of tiles flat:\n", 100.0 * out.flat_tiles / out.tiles);
+    bench_report("laplacian, every pixel filtered", skip_seconds[0], w, h, BENCH_RUNS);
+    bench_report("laplacian, flat tiles skipped", skip_seconds[1], w, h, BENCH_RUNS);
+    free(out.laplacian);
+    free(image);
+
+    //Layout sweep: the scanline fused pass against the tiled layout, with and without its conversions.
+    printf("layout sweep (laplacian):\n");
+    for(unsigned long int size = 256; size <= 4096; size *= 2)
+    {
+        double scanline_seconds = 0, tiled_seconds = 0, filter_seconds = 0;
+        image = bench_image(size, size);
+        for(int run = 0; run < BENCH_RUNS; run++)
+        {
+            reference = apply_filters(image, size, size, &scanline_seconds);
+            result = apply_filters_tiled(image, size, size, &tiled_seconds, &filter_seconds);
+            if(run == 0 && memcmp(result, reference, size * size * sizeof(PPMPixel)) != 0)
+            {
+                printf("  tiled layout output differs from the reference\n");
+            }
+            free(reference);
+            free(result);
+        }
+        printf("  %4lux%-4lu scanline %8.4f s  tiled %8.4f s (filter alone %8.4f s)\n", size, size,
+               scanline_seconds / BENCH_RUNS, tiled_seconds / BENCH_RUNS, filter_seconds / BENCH_RUNS);
+        free(image);
+    }
+
+    //Kernel size sweep: direct (generated code where possible) against FFT, with a random odd-sized kernel.
+    w = h = BENCH_SWEEP_SIZE;
+    image = bench_image(w, h);
+    int crossover = 0;
+    struct kernel *sweep = malloc(sizeof(struct kernel));
+    unsigned int seed = 777;
+    printf("kernel size sweep: %lux%lu\n", w, h);
+    for(int size = 3; size <= BENCH_SWEEP_LARGEST; size += 2)
+    {
+        double direct_seconds = 0, fft_seconds = 0;
+        sweep->w = sweep->h = size;
+        sweep->divisor = size * size;
+        for(int i = 0; i < size * size; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            sweep->coefficients[i] = (int)(seed >> 16) % 7 - 2;
+        }
+        reference = apply_kernel(sweep, KERNEL_JIT, image, w, h, &direct_seconds);
+        result = apply_kernel(sweep, KERNEL_FFT, image, w, h, &fft_seconds);
+        printf("  %2dx%-2d direct %8.4f s  fft %8.4f s%s\n", size, size, direct_seconds, fft_seconds,
+               memcmp(result, reference, w * h * sizeof(PPMPixel)) ? "  (outputs differ)" : "");
+        if(!crossover && fft_seconds < direct_seconds) crossover = size;
+        free(reference);
+        free(result);
+    }
+    if(crossover)
+        printf("measured FFT crossover: %dx%d (current --fft-crossover=%d)\n", crossover, crossover, fft_crossover);
+    else
+        printf("direct convolution won at every size up to %dx%d\n", BENCH_SWEEP_LARGEST, BENCH_SWEEP_LARGEST);
+    free(sweep);
+    free(image);
+    return 0;
+}
+
+/* Map a raw input file of at least minimum bytes, or read it from stdin when filename is "-".
+ Return: the data and its size in *size, or NULL with a message on stderr.
+ */
+unsigned char *map_input_file(const char *filename, unsigned long int minimum, unsigned long int *size)
+{
+    if(strcmp(filename, "-") == 0)
+    {
+        unsigned char *data = malloc(minimum);
+        if(fread(data, minimum, 1, stdin) != 1)
+        {
+            fprintf(stderr, "stdin is shorter than one %lu byte frame\n", minimum);
+            free(data);
+            return NULL;
+        }
+        *size = minimum;
+        return data;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    if((unsigned long int)st.st_size < minimum)
+    {
+        fprintf(stderr, "'%s' is smaller than one %lu byte frame\n", filename, minimum);
+        close(fd);
+        return NULL;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map file '%s'\n", filename);
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+void unmap_input_file(const char *filename, unsigned char *data, unsigned long int size)
+{
+    if(strcmp(filename, "-") == 0) free(data);
+    else munmap(data, size);
+}
+
+/* Raw camera frames.
+ With --yuv=FORMAT:WxH[:STRIDE] every input is a file (or "-" for stdin) of back to back NV12, I420 or YUYV frames.
+ The Laplacian runs on the luma samples only, straight out of the frame buffer: no colour conversion, no RGB image, and
+ for files no copy at all since the file is mapped. Each frame i.k is written as laplaciani.pgm, or laplaciani_k.pgm
+ when the input holds more than one frame (always for stdin). With --motion, output k is the Laplacian of the luma
+ difference between frames k and k+1.
+ */
+enum yuv_format { YUV_NONE, YUV_NV12, YUV_I420, YUV_YUYV };
+
+struct yuv_geometry {
+    enum yuv_format format;
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int stride;    //bytes per luma row (per packed row for YUYV)
+};
+
+struct yuv_geometry yuv_input = { YUV_NONE, 0, 0, 0 };
+
+/* Parse "nv12:640x480" or "yuyv:640x480:1288" into g.
+ Return: 0 on success, -1 otherwise.
+ */
+int parse_yuv_geometry(const char *arg, struct yuv_geometry *g)
+{
+    char name[8];
+    unsigned long int stride = 0;
+    int fields = sscanf(arg, "%7[^:]:%lux%lu:%lu", name, &g->w, &g->h, &stride);
+    if(fields < 3 || g->w == 0 || g->h == 0)
+    {
+        return -1;
+    }
+    if(strcmp(name, "nv12") == 0) g->format = YUV_NV12;
+    else if(strcmp(name, "i420") == 0) g->format = YUV_I420;
+    else if(strcmp(name, "yuyv") == 0) g->format = YUV_YUYV;
+    else return -1;
+
+    unsigned long int minimum = g->format == YUV_YUYV ? 2 * g->w : g->w;
+    g->stride = fields == 4 ? stride : minimum;
+    if(g->stride < minimum || (g->format != YUV_YUYV && g->h % 2) || g->w % 2)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Return: bytes in one frame of geometry g. */
+unsigned long int yuv_frame_size(const struct yuv_geometry *g)
+{
+    switch(g->format)
+    {
+        case YUV_NV12: return g->stride * g->h + g->stride * (g->h / 2);
+        case YUV_I420: return g->stride * g->h + 2 * ((g->stride / 2) * (g->h / 2));
+        case YUV_YUYV: return g->stride * g->h;
+        default: return 0;
+    }
+}
+
+/* Filter the luma of one frame, or its difference from previous, and write it. */
+void process_yuv_frame(const unsigned char *frame, const unsigned char *previous, const struct yuv_geometry *g, const char *output_file_name)
+{
+    //The Y plane comes first in NV12 and I420; in YUYV every other byte of a row is a Y sample.
+    unsigned long int step = g->format == YUV_YUYV ? 2 : 1;
+    unsigned char *result = apply_filters_gray_motion(frame, previous, g->stride, step, g->w, g->h, &total_elapsed_time);
+    write_gray_image(result, (char *)output_file_name, g->w, g->h);
+    free(result);
+}
+
+/* Frame streams.
+ --stream treats every input (a file, a pipe, or "-" for stdin) as back to back P6 frames and writes the Laplacian of
+ frame k, computed by the band-parallel apply_filters, as laplaciani_k.ppm.
+ --realtime[=N] changes how streams (--stream, and --yuv inputs) are consumed, for live sources that can outrun the
+ filter. A reader thread keeps taking frames off the input, and only the N newest frames not yet filtered (default 1)
+ wait for the filter. When another frame arrives, the oldest waiting one is dropped and counted, so the filter always
+ gets the freshest frames and the latency stays bounded. Outputs keep the frame's number in the stream, so dropped
+ frames leave gaps. At the end of each stream the frame counts and the percentiles of the latency from a frame being
+ read to its result being written are printed to stderr.
+ */
+#define DEFAULT_REALTIME_DEPTH 1
+
+/* One frame buffer of a stream. */
+struct stream_slot {
+    unsigned char *data;
+    unsigned long int capacity;      //bytes allocated at data
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int sequence;      //1-based position of the frame in the stream
+    struct timeval arrival;          //when the frame had been read completely
+};
+
+/* The frames waiting between the reader thread and the filter. With depth N there are N + 2 slots: N waiting, one being
+ read into and one being filtered, so the reader always finds a slot without waiting for the filter.
+ */
+struct frame_queue {
+    FILE *fp;
+    int (*read_frame)(FILE *fp, struct stream_slot *slot);
+    struct stream_slot *slots;
+    int *free_slots;                 //slots holding no frame
+    int free_count;
+    int *waiting;                    //ring of depth slots, oldest first
+    int head;
+    int count;
+    int depth;
+    int finished;                    //the reader reached the end of the input
+    unsigned long int frames_read;
+    unsigned long int frames_dropped;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+int stream_enabled = 0;
+int realtime_depth = 0;              //0: frames are filtered one after the other as they are read
+
+/* Read the next header number of a P6 frame, skipping whitespace and comments.
+ Return: 0 on success, -1 otherwise.
+ */
+int read_header_number(FILE *fp, unsigned long int *value)
+{
+    int c = getc(fp);
+    while(c == '#' || isspace(c))
+    {
+        if(c == '#') while(c != '\n' && c != EOF) c = getc(fp);
+        c = getc(fp);
+    }
+    ungetc(c, fp);
+    return fscanf(fp, "%lu", value) == 1 ? 0 : -1;
+}
+
+/* Read the next P6 frame of a stream into slot.
+ Return: 1 if a frame was read, 0 at the end of the stream or on a malformed frame.
+ */
+int read_ppm_frame(FILE *fp, struct stream_slot *slot)
+{
+    unsigned long int maxval;
+    int c = getc(fp);
+    while(isspace(c)) c = getc(fp);
+    if(c == EOF) return 0;
+    if(c != 'P' || getc(fp) != '6' || read_header_number(fp, &slot->w) || read_header_number(fp, &slot->h)
+       || read_header_number(fp, &maxval) || maxval != RGB_COMPONENT_COLOR || !isspace(getc(fp)))
+    {
+        fprintf(stderr, "Invalid frame header in the stream, must be 'P6' with 255 components\n");
+        return 0;
+    }
+    unsigned long int size = slot->w * slot->h * sizeof(PPMPixel);
+    if(size > slot->capacity)
+    {
+        slot->data = realloc(slot->data, size);
+        slot->capacity = size;
+    }
+    return fread(slot->data, 1, size, fp) == size;
+}
+
+/* Read the next --yuv frame of a stream into slot.
+ Return: 1 if a frame was read, 0 at the end of the stream.
+ */
+int read_yuv_frame(FILE *fp, struct stream_slot *slot)
+{
+    unsigned long int size = yuv_frame_size(&yuv_input);
+    if(size > slot->capacity)
+    {
+        slot->data = realloc(slot->data, size);
+        slot->capacity = size;
+    }
+    slot->w = yuv_input.w;
+    slot->h = yuv_input.h;
+    return fread(slot->data, size, 1, fp) == 1;
+}
+
+/* This is the thread function of the stream reader: it reads frames until the end of the input, dropping the oldest
+ waiting frame whenever depth frames are already waiting.
+ */
+void *stream_reader_threadfn(void *args)
+{
+    struct frame_queue *queue = (struct frame_queue *) args;
+    pthread_mutex_lock(&queue->lock);
+    int filling = queue->free_slots[--queue->free_count];
+    pthread_mutex_unlock(&queue->lock);
+
+    while(queue->read_frame(queue->fp, &queue->slots[filling]))
+    {
+        gettimeofday(&queue->slots[filling].arrival, NULL);
+        pthread_mutex_lock(&queue->lock);
+        queue->slots[filling].sequence = ++queue->frames_read;
+        int next;
+        if(queue->count == queue->depth)
+        {
+            //The oldest waiting frame is stale: its slot takes the next frame.
+            next = queue->waiting[queue->head];
+            queue->head = (queue->head + 1) % queue->depth;
+            queue->count--;
+            queue->frames_dropped++;
+        }
+        else
+        {
+            next = queue->free_slots[--queue->free_count];
+        }
+        queue->waiting[(queue->head + queue->count) % queue->depth] = filling;
+        queue->count++;
+        filling = next;
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->finished = 1;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/* Hand back the slot of the frame filtered last (done, -1 for none) and take the oldest waiting frame.
+ Return: its slot, or -1 once the stream has ended and nothing is waiting
+ */
+int frame_queue_take(struct frame_queue *queue, int done)
+{
+    int slot = -1;
+    pthread_mutex_lock(&queue->lock);
+    if(done >= 0) queue->free_slots[queue->free_count++] = done;
+    while(queue->count == 0 && !queue->finished)
+    {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+    if(queue->count > 0)
+    {
+        slot = queue->waiting[queue->head];
+        queue->head = (queue->head + 1) % queue->depth;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return slot;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Sort the n latencies in milliseconds and print their percentiles to stderr. */
+void report_latencies(double *latencies, unsigned long int n)
+{
+    if(n == 0) return;
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    fprintf(stderr, "; latency ms p50 %.2f, p90 %.2f, p99 %.2f, max %.2f", latencies[(n - 1) / 2], latencies[(n - 1) * 9 / 10],
+            latencies[(n - 1) * 99 / 100], latencies[n - 1]);
+}
+
+/* Filter every frame of a stream with process, which writes output index_k for frame k: one after the other as they are
+ read, or under the --realtime policy with a reader thread.
+ */
+void run_stream(FILE *fp, int (*read_frame)(FILE *fp, struct stream_slot *slot), void (*process)(const struct stream_slot *slot, int index), int index, const char *label)
+{
+    if(realtime_depth == 0)
+    {
+        struct stream_slot slot = { 0 };
+        while(read_frame(fp, &slot))
+        {
+            slot.sequence++;
+            process(&slot, index);
+        }
+        free(slot.data);
+        return;
+    }
+
+    struct frame_queue queue = { 0 };
+    int slot_count = realtime_depth + 2;
+    queue.fp = fp;
+    queue.read_frame = read_frame;
+    queue.depth = realtime_depth;
+    queue.slots = calloc(slot_count, sizeof(struct stream_slot));
+    queue.free_slots = malloc(slot_count * sizeof(int));
+    queue.waiting = malloc(realtime_depth * sizeof(int));
+    for(int i = 0; i < slot_count; i++) queue.free_slots[queue.free_count++] = i;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+
+    pthread_t reader;
+    if(pthread_create(&reader, NULL, stream_reader_threadfn, (void*)&queue) != 0)
+    {
+        fprintf(stderr, "Unable to create the reader thread of %s\n", label);
+        return;
+    }
+
+    unsigned long int processed = 0, latency_capacity = 256;
+    double *latencies = malloc(latency_capacity * sizeof(double));
+    int slot = -1;
+    while((slot = frame_queue_take(&queue, slot)) >= 0)
+    {
+        struct timeval done;
+        process(&queue.slots[slot], index);
+        gettimeofday(&done, NULL);
+        if(processed == latency_capacity)
+        {
+            latency_capacity *= 2;
+            latencies = realloc(latencies, latency_capacity * sizeof(double));
+        }
+        latencies[processed++] = (double)(done.tv_sec - queue.slots[slot].arrival.tv_sec) * 1000.0 + (double)(done.tv_usec - queue.slots[slot].arrival.tv_usec) / 1000.0;
+    }
+    pthread_join(reader, NULL);
+
+    fprintf(stderr, "realtime %s: %lu frames read, %lu filtered, %lu dropped", label, queue.frames_read, processed, queue.frames_dropped);
+    report_latencies(latencies, processed);
+    fprintf(stderr, "\n");
+
+    free(latencies);
+    for(int i = 0; i < slot_count; i++) free(queue.slots[i].data);
+    free(queue.waiting);
+    free(queue.free_slots);
+    free(queue.slots);
+    pthread_cond_destroy(&queue.ready);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+/* Filter one P6 frame of a stream and write it as laplacianindex_k.ppm. */
+void process_ppm_stream_frame(const struct stream_slot *slot, int index)
+{
+    char output_file_name[64];
+    snprintf(output_file_name, sizeof(output_file_name), "laplacian%d_%lu.ppm", index, slot->sequence);
+    PPMPixel *result = apply_filters((PPMPixel *)slot->data, slot->w, slot->h, &total_elapsed_time);
+    write_image(result, output_file_name, slot->w, slot->h);
+    free(result);
+}
+
+/* Filter the luma of one --yuv frame of a stream and write it as laplacianindex_k.pgm. */
+void process_yuv_stream_frame(const struct stream_slot *slot, int index)
+{
+    char output_file_name[64];
+    snprintf(output_file_name, sizeof(output_file_name), "laplacian%d_%lu.pgm", index, slot->sequence);
+    process_yuv_frame(slot->data, NULL, &yuv_input, output_file_name);
+}
+
+/* Open a stream input: "-" is stdin.
+ Return: the stream, or NULL if it cannot be opened
+ */
+FILE *open_stream(const char *filename)
+{
+    if(strcmp(filename, "-") == 0) return stdin;
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) fprintf(stderr, "Unable to open file '%s'\n", filename);
+    return fp;
+}
+
+/* The thread function that manages a --stream input of back to back P6 frames. */
+void *manage_stream_file(void *args)
+{
+    struct file_name_args* file_name = (struct file_name_args*) args;
+    FILE *fp = open_stream(file_name->input_file_name);
+    if(!fp)
+    {
+        return NULL;
+    }
+    run_stream(fp, read_ppm_frame, process_ppm_stream_frame, file_name->index, file_name->input_file_name);
+    if(fp != stdin) fclose(fp);
+    return NULL;
+}
+
+/* Shared memory rings.
+ --shm-in=NAME takes frames from the POSIX shared memory ring NAME (see shm_ring.h) instead of files: a producer process
+ such as shm_bench creates the ring and writes RGB frames into its slots, and each frame is filtered where it lies.
+ With --shm-out=NAME the Laplacian is written straight into a slot of a second ring of the same geometry, created
+ here for the next process; otherwise frame k is written as laplacian1_k.ppm. The frame number and first ring
+ timestamp travel with the result, and the throughput and the latency percentiles are printed to stderr at the end.
+ */
+#define SHM_ATTACH_TIMEOUT 10000     //milliseconds to wait for the input ring to appear
+
+const char *shm_input_name = NULL;
+const char *shm_output_name = NULL;
+
+/* Filter every frame of the --shm-in ring until its producer closes it.
+ Return: 0 on success, 1 otherwise.
+ */
+int run_shm_ring(void)
+{
+    struct shm_ring input, output = { 0 };
+    if(shm_ring_attach(&input, shm_input_name, SHM_ATTACH_TIMEOUT) != 0)
+    {
+        return 1;
+    }
+    unsigned long int w = input.header->width, h = input.header->height;
+    if(shm_output_name && shm_ring_create(&output, shm_output_name, input.header->slot_count, w, h) != 0)
+    {
+        shm_ring_detach(&input);
+        return 1;
+    }
+
+    unsigned long int processed = 0, latency_capacity = 256;
+    double *latencies = malloc(latency_capacity * sizeof(double));
+    uint64_t started = 0;
+    struct shm_ring_slot *slot;
+    while((slot = shm_ring_next(&input)) != NULL)
+    {
+        PPMPixel *image = (PPMPixel *)shm_ring_pixels(slot);
+        if(processed == 0) started = shm_ring_now();
+        if(shm_output_name)
+        {
+            struct shm_ring_slot *result = shm_ring_acquire(&output);
+            struct filter_outputs out = { 0 };
+            out.laplacian = (PPMPixel *)shm_ring_pixels(result);
+            out.threshold = threshold_value;
+            apply_fused_filters(image, w, h, &out, &total_elapsed_time);
+            result->sequence = slot->sequence;
+            result->timestamp = slot->timestamp;
+            shm_ring_publish(&output);
+        }
+        else
+        {
+            char output_file_name[64];
+            snprintf(output_file_name, sizeof(output_file_name), "laplacian1_%llu.ppm", (unsigned long long)slot->sequence);
+            PPMPixel *result = apply_filters(image, w, h, &total_elapsed_time);
+            write_image(result, output_file_name, w, h);
+            free(result);
+        }
+        uint64_t timestamp = slot->timestamp;
+        shm_ring_release(&input);
+
+        if(processed == latency_capacity)
+        {
+            latency_capacity *= 2;
+            latencies = realloc(latencies, latency_capacity * sizeof(double));
+        }
+        latencies[processed++] = (double)(shm_ring_now() - timestamp) / 1000000.0;
+    }
+    double seconds = processed > 0 ? (double)(shm_ring_now() - started) / 1000000000.0 : 0.0;
+
+    fprintf(stderr, "shm %s: %lu frames of %lux%lu in %.3f s, %.1f frames/s", shm_input_name, processed, w, h, seconds,
+            seconds > 0 ? processed / seconds : 0.0);
+    report_latencies(latencies, processed);
+    fprintf(stderr, "\n");
+
+    free(latencies);
+    if(shm_output_name)
+    {
+        shm_ring_close(&output);
+        shm_ring_drain(&output, SHM_ATTACH_TIMEOUT);
+        shm_ring_detach(&output);
+    }
+    shm_ring_detach(&input);
+    return 0;
+}
+
+/* The thread function that manages a raw camera file: maps it, or reads stdin frame by frame. */
+void *manage_yuv_file(void *args)
+{
+    struct file_name_args* file_name = (struct file_name_args*) args;
+    unsigned long int frame_size = yuv_frame_size(&yuv_input);
+    char output_file_name[64];
+
+    //Live sources are read by a thread of their own under the --realtime policy.
+    if(realtime_depth > 0)
+    {
+        FILE *fp = open_stream(file_name->input_file_name);
+        if(fp)
+        {
+            run_stream(fp, read_yuv_frame, process_yuv_stream_frame, file_name->index, file_name->input_file_name);
+            if(fp != stdin) fclose(fp);
+        }
+        return NULL;
+    }
+
+    if(strcmp(file_name->input_file_name, "-") == 0)
+    {
+        unsigned char *frame = malloc(frame_size);
+        unsigned char *previous = motion_enabled ? malloc(frame_size) : NULL;
+        if(previous && fread(previous, frame_size, 1, stdin) != 1)
+        {
+            free(previous);
+            free(frame);
+            return NULL;
+        }
+        for(unsigned long int k = 1; fread(frame, frame_size, 1, stdin) == 1; k++)
+        {
+            snprintf(output_file_name, sizeof(output_file_name), "laplacian%d_%lu.pgm", file_name->index, k);
+            process_yuv_frame(frame, previous, &yuv_input, output_file_name);
+            if(previous)
+            {
+                //The frame just read is the previous one of the next.
+                unsigned char *swap = previous;
+                previous = frame;
+                frame = swap;
+            }
+        }
+        free(previous);
+        free(frame);
+        return NULL;
+    }
+
+    unsigned long int mapped_size;
+    unsigned char *data = map_input_file(file_name->input_file_name, frame_size, &mapped_size);
+    if(!data)
+    {
+        return NULL;
+    }
+    unsigned long int frames = mapped_size / frame_size;
+    //In motion mode the first frame only serves as the previous one of the second.
+    unsigned long int first = motion_enabled ? 1 : 0;
+    if(frames <= first)
+    {
+        fprintf(stderr, "%s: --motion needs at least two frames\n", file_name->input_file_name);
+    }
+
+    for(unsigned long int k = first; k < frames; k++)
+    {
+        if(frames - first == 1)
+            snprintf(output_file_name, sizeof(output_file_name), "laplacian%d.pgm", file_name->index);
+        else
+            snprintf(output_file_name, sizeof(output_file_name), "laplacian%d_%lu.pgm", file_name->index, k - first + 1);
+        process_yuv_frame(data + k * frame_size, first ? data + (k - 1) * frame_size : NULL, &yuv_input, output_file_name);
+    }
+    unmap_input_file(file_name->input_file_name, data, mapped_size);
+    return NULL;
+}
+
+/* Raw Bayer frames.
+ With --bayer=PATTERN:WxH[:BITS] every input holds one raw mosaic frame: 8-bit samples, or little-endian 16-bit
+ containers when BITS (the significant bits, default 8) is above 8. Edges are found without demosaicing:
+   luma  (default) each 2x2 cell becomes one luma sample, (77 R + 75 G + 75 G + 29 B) / 256, and the Laplacian of
+         that half resolution plane is written;
+   cfa   a full resolution Laplacian whose taps sit two pixels apart, so every tap reads the same colour as the centre.
+ Both are band-parallel like apply_filters and write laplaciani.pgm, scaled down to 8 bits.
+ */
+enum bayer_mode { BAYER_LUMA, BAYER_CFA };
+
+struct bayer_geometry {
+    int enabled;
+    int red_x;               //position of the red sample in each 2x2 cell
+    int red_y;
+    unsigned long int w;
+    unsigned long int h;
+    int bits;                //significant bits per sample
+    enum bayer_mode mode;
+};
+
+struct bayer_parameter {
+    const unsigned char *image;  //raw mosaic
+    const struct bayer_geometry *geometry;
+    unsigned char *result;       //luma plane (luma mode) or filtered mosaic (cfa mode)
+    unsigned long int start;     //starting output row
+    unsigned long int size;      //output rows of this thread
+};
+
+struct bayer_geometry bayer_input = { 0, 0, 0, 0, 0, 8, BAYER_LUMA };
+
+/* Parse "rggb:1920x1080:12" into g.
+ Return: 0 on success, -1 otherwise.
+ */
+int parse_bayer_geometry(const char *arg, struct bayer_geometry *g)
+{
+    char pattern[8];
+    int bits = 8;
+    int fields = sscanf(arg, "%7[^:]:%lux%lu:%d", pattern, &g->w, &g->h, &bits);
+    if(fields < 3 || g->w < 2 || g->h < 2 || g->w % 2 || g->h % 2 || bits < 8 || bits > 16)
+    {
+        return -1;
+    }
+    if(strcmp(pattern, "rggb") == 0) { g->red_x = 0; g->red_y = 0; }
+    else if(strcmp(pattern, "grbg") == 0) { g->red_x = 1; g->red_y = 0; }
+    else if(strcmp(pattern, "gbrg") == 0) { g->red_x = 0; g->red_y = 1; }
+    else if(strcmp(pattern, "bggr") == 0) { g->red_x = 1; g->red_y = 1; }
+    else return -1;
+    g->bits = bits;
+    g->enabled = 1;
+    return 0;
+}
+
+/* Return: the little-endian 16-bit sample at p, whatever the byte order of the host. */
+unsigned int load_le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+unsigned int bayer_sample(const unsigned char *image, const struct bayer_geometry *g, unsigned long int x, unsigned long int y)
+{
+    if(g->bits == 8) return image[y * g->w + x];
+    return load_le16(image + 2 * (y * g->w + x));
+}
+
+/* Luma of one row of 2x2 cells from its top and bottom mosaic rows, for 8 and 16-bit samples. weights[row][column] is
+ the weight of each sample of a cell, so the colour pattern is resolved once per row rather than once per sample.
+ */
+void bayer_luma_row_8(const unsigned char *top, const unsigned char *bottom, unsigned char *out, unsigned long int half, const unsigned int weights[2][2])
+{
+    //Local copies: out may alias anything, so the weights would otherwise be reloaded for every cell.
+    unsigned int t0 = weights[0][0], t1 = weights[0][1], b0 = weights[1][0], b1 = weights[1][1];
+    for(unsigned long int cx = 0; cx < half; cx++)
+    {
+        out[cx] = (t0 * top[2*cx] + t1 * top[2*cx+1] + b0 * bottom[2*cx] + b1 * bottom[2*cx+1]) >> 8;
+    }
+}
+
+void bayer_luma_row_16(const unsigned char *top, const unsigned char *bottom, unsigned char *out, unsigned long int half, const unsigned int weights[2][2], int shift)
+{
+    unsigned int t0 = weights[0][0], t1 = weights[0][1], b0 = weights[1][0], b1 = weights[1][1];
+    for(unsigned long int cx = 0; cx < half; cx++)
+    {
+        unsigned int sum = t0 * load_le16(top + 4*cx) + t1 * load_le16(top + 4*cx + 2) + b0 * load_le16(bottom + 4*cx) + b1 * load_le16(bottom + 4*cx + 2);
+        out[cx] = sum >> (8 + shift);
+    }
+}
+
+/* Same-colour Laplacian of one mosaic row from the rows two above (a) and two below (c), columns from to to, for 8 and
+ 16-bit samples. The caller keeps the columns at least two away from the edges, so no tap wraps. 16-bit rows are
+ given as bytes and decoded as little-endian.
+ */
+void bayer_cfa_row_8(const unsigned char *a, const unsigned char *b, const unsigned char *c, unsigned char *out, unsigned long int from, unsigned long int to)
+{
+    for(unsigned long int x = from; x < to; x++)
+    {
+        int sum = 8 * b[x] - a[x-2] - a[x] - a[x+2] - b[x-2] - b[x+2] - c[x-2] - c[x] - c[x+2];
+        out[x] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+    }
+}
+
+void bayer_cfa_row_16(const unsigned char *a, const unsigned char *b, const unsigned char *c, unsigned char *out, unsigned long int from, unsigned long int to, int shift)
+{
+    for(unsigned long int x = from; x < to; x++)
+    {
+        int sum = 8 * load_le16(b + 2*x) - load_le16(a + 2*x - 4) - load_le16(a + 2*x) - load_le16(a + 2*x + 4)
+            - load_le16(b + 2*x - 4) - load_le16(b + 2*x + 4) - load_le16(c + 2*x - 4) - load_le16(c + 2*x) - load_le16(c + 2*x + 4);
+        sum = sum < 0 ? 0 : sum >> shift;
+        out[x] = sum > 255 ? 255 : sum;
+    }
+}
+
+/* This is the thread function for Bayer input. In luma mode it fills rows start to start+size of the half resolution
+ luma plane, in cfa mode it filters those rows of the mosaic directly. Both walk whole rows with the loops above and
+ keep bayer_sample for the wrapping edge columns. 16-bit samples are read as little-endian.
+ */
+void *compute_bayer_threadfn(void *params)
+{
+    struct bayer_parameter *param = (struct bayer_parameter *) params;
+    const struct bayer_geometry *g = param->geometry;
+    unsigned long int w = g->w, h = g->h;
+    int shift = g->bits - 8;
+    int wide = g->bits > 8;
+
+    if(g->mode == BAYER_LUMA)
+    {
+        unsigned long int half = w / 2, row = wide ? 2 * w : w;
+        //Green weighs 75 wherever red and blue are not.
+        unsigned int weights[2][2] = { { 75, 75 }, { 75, 75 } };
+        weights[g->red_y][g->red_x] = 77;
+        weights[1 - g->red_y][1 - g->red_x] = 29;
+        for(unsigned long int cy = param->start; cy < param->start + param->size; cy++)
+        {
+            const unsigned char *top = param->image + 2 * cy * row;
+            if(wide) bayer_luma_row_16(top, top + row, param->result + cy * half, half, weights, shift);
+            else bayer_luma_row_8(top, top + row, param->result + cy * half, half, weights);
+        }
+        return NULL;
+    }
+
+    for(unsigned long int y = param->start; y < param->start + param->size; y++)
+    {
+        unsigned long int up = (y + h - 2) % h, down = (y + 2) % h;
+        unsigned char *out = param->result + y * w;
+
+        if(w > 4)
+        {
+            if(wide)
+            {
+                bayer_cfa_row_16(param->image + 2 * up * w, param->image + 2 * y * w, param->image + 2 * down * w, out, 2, w - 2, shift);
+            }
+            else
+            {
+                bayer_cfa_row_8(param->image + up * w, param->image + y * w, param->image + down * w, out, 2, w - 2);
+            }
+        }
+
+        //The two columns at each edge wrap around.
+        for(unsigned long int x = 0; x < w; x++)
+        {
+            if(w > 4 && x == 2) x = w - 2;
+            unsigned long int left = (x + w - 2) % w, right = (x + 2) % w;
+            long int sum = 8 * (long int)bayer_sample(param->image, g, x, y)
+                - bayer_sample(param->image, g, left, up) - bayer_sample(param->image, g, x, up) - bayer_sample(param->image, g, right, up)
+                - bayer_sample(param->image, g, left, y) - bayer_sample(param->image, g, right, y)
+                - bayer_sample(param->image, g, left, down) - bayer_sample(param->image, g, x, down) - bayer_sample(param->image, g, right, down);
+            sum = sum < 0 ? 0 : sum >> shift;
+            out[x] = sum > 255 ? 255 : sum;
+        }
+    }
+    return NULL;
+}
+
+/* Run compute_bayer_threadfn over rows output rows using threads, split into bands like apply_filters. */
+void run_bayer_bands(const unsigned char *image, const struct bayer_geometry *g, unsigned char *result, unsigned long int rows)
+{
+    struct bayer_parameter params[LAPLACIAN_THREADS];
+    pthread_t t[LAPLACIAN_THREADS];
+    int work = rows / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].image = image;
+        params[i].geometry = g;
+        params[i].result = result;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? rows - params[i].start : work;
+        if(pthread_create(&t[i], NULL, compute_bayer_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(t[i], NULL);
+    }
+}
+
+/* The thread function that manages a raw Bayer file. */
+void *manage_bayer_file(void *args)
+{
+    struct file_name_args* file_name = (struct file_name_args*) args;
+    const struct bayer_geometry *g = &bayer_input;
+    unsigned long int frame_size = g->w * g->h * (g->bits > 8 ? 2 : 1);
+    unsigned long int mapped_size;
+    char output_file_name[64];
+    unsigned char *result;
+
+    unsigned char *data = map_input_file(file_name->input_file_name, frame_size, &mapped_size);
+    if(!data)
+    {
+        return NULL;
+    }
+    snprintf(output_file_name, sizeof(output_file_name), "laplacian%d.pgm", file_name->index);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    if(g->mode == BAYER_LUMA)
+    {
+        unsigned char *luma = malloc(g->w / 2 * (g->h / 2));
+        double luma_time = 0;
+        run_bayer_bands(data, g, luma, g->h / 2);
+        result = apply_filters_gray(luma, g->w / 2, 1, g->w / 2, g->h / 2, &luma_time);
+        free(luma);
+    }
+    else
+    {
+        result = malloc(g->w * g->h);
+        run_bayer_bands(data, g, result, g->h);
+    }
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    total_elapsed_time += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+
+    if(g->mode == BAYER_LUMA)
+        write_gray_image(result, output_file_name, g->w / 2, g->h / 2);
+    else
+        write_gray_image(result, output_file_name, g->w, g->h);
+    free(result);
+    unmap_input_file(file_name->input_file_name, data, mapped_size);
+    return NULL;
+}
+
+/* Corners.
+ The structure tensor of r, g and b (the same Sobel gradient products as the Di Zenzo operator) is summed over a
+ separable box or binomial window and turned into a Harris (det - k trace^2) or Shi-Tomasi (smaller eigenvalue)
+ response. The products come out of the fused pass, from the gradients it already takes for its other operators, like
+ the HOG stage's magnitude and orientation, and are held for the whole image (12 bytes per pixel) between the two
+ stages. Each thread then walks its band row by row: the products of a row are summed horizontally and kept in a ring
+ of 2R+1 rows, so the vertical sum of the window is ready as soon as its last row is. A second phase keeps the local
+ maxima of the band that reach CORNER_QUALITY of the strongest response and sorts them; the bands' lists are merged
+ into the strongest corner_count corners, written as cornersi.txt.
+ */
+#define MAX_CORNER_RADIUS 15
+#define CORNER_QUALITY 0.01f     //fraction of the strongest response a corner must reach
+#define HARRIS_K 0.04f
+#define DEFAULT_CORNER_COUNT 500
+
+enum corner_method {CORNER_HARRIS, CORNER_SHI_TOMASI, CORNER_METHOD_COUNT};
+const char *corner_method_names[CORNER_METHOD_COUNT] = { "harris", "shi-tomasi" };
+
+enum corner_phase { CORNER_RESPONSE, CORNER_SELECT };
+
+struct corner_point {
+    unsigned long int x;
+    unsigned long int y;
+    float response;
+};
+
+struct corner_parameter {
+    enum corner_phase phase;
+    const float *tensor;         //gradient products from the fused pass, 3 per pixel
+    float *response;             //one value per pixel
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int start;
+    unsigned long int size;
+    float strongest;             //CORNER_RESPONSE: largest response in the band
+    float floor;                 //CORNER_SELECT: weakest response kept
+    struct corner_point *points; //CORNER_SELECT: maxima of the band, strongest first
+    unsigned long int count;
+};
+
+int corners_enabled = 0;
+enum corner_method corner_method = CORNER_HARRIS;
+int corner_radius = 2;
+int corner_gaussian = 1;         //binomial window instead of a box
+unsigned long int corner_count = DEFAULT_CORNER_COUNT;
+
+/* Parse a --corner-window argument: [box:|gauss:]R.
+ Return: 0 on success, -1 otherwise.
+ */
+int parse_corner_window(const char *arg)
+{
+    char *end;
+    int gaussian = corner_gaussian;
+    if(strncmp(arg, "box:", 4) == 0)
+    {
+        gaussian = 0;
+        arg += 4;
+    }
+    else if(strncmp(arg, "gauss:", 6) == 0)
+    {
+        gaussian = 1;
+        arg += 6;
+    }
+    long int radius = strtol(arg, &end, 10);
+    if(end == arg || *end || radius < 1 || radius > MAX_CORNER_RADIUS) return -1;
+    corner_radius = radius;
+    corner_gaussian = gaussian;
+    return 0;
+}
+
+/* Order corners strongest first, ties in scanline order. */
+int compare_corners(const void *a, const void *b)
+{
+    const struct corner_point *p = a, *q = b;
+    if(p->response != q->response) return p->response > q->response ? -1 : 1;
+    if(p->y != q->y) return p->y < q->y ? -1 : 1;
+    return p->x < q->x ? -1 : (p->x > q->x);
+}
+
+/* Sum the gradient products of row y over the window horizontally into sums (3 per pixel). */
+void corner_row_sums(const struct corner_parameter *param, unsigned long int y, const float *weights, float *sums)
+{
+    unsigned long int w = param->w;
+    const float *products = param->tensor + 3 * y * w;
+
+    int n = 2 * corner_radius + 1;
+    for(unsigned long int x = 0; x < w; x++)
+    {
+        float sx = 0, sy = 0, sxy = 0;
+        for(int d = 0; d < n; d++)
+        {
+            unsigned long int xs = (x + w * (MAX_CORNER_RADIUS + 1) + d - corner_radius) % w;
+            sx += weights[d] * products[3*xs];
+            sy += weights[d] * products[3*xs+1];
+            sxy += weights[d] * products[3*xs+2];
+        }
+        sums[3*x] = sx;
+        sums[3*x+1] = sy;
+        sums[3*x+2] = sxy;
+    }
+}
+
+/* This is the thread function of the corner detector, for rows start to start+size.
+ CORNER_RESPONSE: the response of every pixel of the band, and the strongest one.
+ CORNER_SELECT: the local maxima of the band that reach floor, strongest first.
+ */
+void *compute_corners_threadfn(void *params)
+{
+    struct corner_parameter *param = (struct corner_parameter *) params;
+    unsigned long int w = param->w, h = param->h;
+
+    if(param->phase == CORNER_RESPONSE)
+    {
+        int n = 2 * corner_radius + 1;
+        float weights[2 * MAX_CORNER_RADIUS + 1];
+        float *ring = malloc((size_t)n * 3 * w * sizeof(float));
+
+        //Binomial coefficients approximate a Gaussian; the scale does not matter since corners are ranked.
+        for(int d = 0; d < n; d++)
+        {
+            weights[d] = 1;
+            if(corner_gaussian)
+            {
+                for(int i = 0; i < d; i++) weights[d] = weights[d] * (n - 1 - i) / (i + 1);
+            }
+        }
+
+        param->strongest = 0;
+        for(unsigned long int i = 0; i < param->size + n - 1; i++)
+        {
+            unsigned long int y = (param->start + h * (MAX_CORNER_RADIUS + 1) + i - corner_radius) % h;
+            corner_row_sums(param, y, weights, ring + (i % n) * 3 * w);
+            if(i + 1 < (unsigned long int)n) continue;
+
+            //Rows i-n+1 to i of the ring now cover the window of band row i-n+1.
+            float *response = param->response + (param->start + i + 1 - n) * w;
+            for(unsigned long int x = 0; x < w; x++)
+            {
+                float a = 0, b = 0, c = 0;
+                for(int d = 0; d < n; d++)
+                {
+                    const float *row = ring + ((i + 1 + d) % n) * 3 * w;
+                    a += weights[d] * row[3*x];
+                    b += weights[d] * row[3*x+1];
+                    c += weights[d] * row[3*x+2];
+                }
+                float value;
+                if(corner_method == CORNER_HARRIS) value = a * b - c * c - HARRIS_K * (a + b) * (a + b);
+                else value = (a + b) / 2 - sqrtf((a - b) * (a - b) / 4 + c * c);
+                response[x] = value;
+                if(value > param->strongest) param->strongest = value;
+            }
+        }
+        free(ring);
+        return NULL;
+    }
+
+    unsigned long int capacity = 64;
+    param->points = malloc(capacity * sizeof(struct corner_point));
+    param->count = 0;
+    for(unsigned long int y = param->start; y < param->start + param->size; y++)
+    {
+        for(unsigned long int x = 0; x < w; x++)
+        {
+            float value = param->response[y * w + x];
+            if(value <= 0 || value < param->floor) continue;
+
+            //A plateau keeps its first pixel in scanline order: earlier neighbours may tie, later ones may not.
+            int maximum = 1;
+            for(int dy = -1; dy <= 1 && maximum; dy++)
+            {
+                for(int dx = -1; dx <= 1; dx++)
+                {
+                    if(dy == 0 && dx == 0) continue;
+                    float other = param->response[(y + h + dy) % h * w + (x + w + dx) % w];
+                    int earlier = dy < 0 || (dy == 0 && dx < 0);
+                    if(other > value || (!earlier && other == value))
+                    {
+                        maximum = 0;
+                        break;
+                    }
+                }
+            }
+            if(!maximum) continue;
+            if(param->count == capacity)
+            {
+                capacity *= 2;
+                param->points = realloc(param->points, capacity * sizeof(struct corner_point));
+            }
+            param->points[param->count].x = x;
+            param->points[param->count].y = y;
+            param->points[param->count].response = value;
+            param->count++;
+        }
+    }
+    qsort(param->points, param->count, sizeof(struct corner_point), compare_corners);
+    if(param->count > corner_count) param->count = corner_count;
+    return NULL;
+}
+
+void run_corner_phase(struct corner_parameter *params)
+{
+    pthread_t threads[LAPLACIAN_THREADS];
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        if(pthread_create(&threads[i], NULL, compute_corners_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Find the strongest corner_count corners of an image from the gradient products of the fused pass.
+ Return: the corners, strongest first, with their number in *count.
+ */
+struct corner_point *detect_corners(const float *tensor, unsigned long int w, unsigned long int h, unsigned long int *count, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    struct corner_parameter params[LAPLACIAN_THREADS];
+    float *response = malloc(w * h * sizeof(float));
+    int work = h / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = CORNER_RESPONSE;
+        params[i].tensor = tensor;
+        params[i].response = response;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : (unsigned long int)work;
+    }
+    run_corner_phase(params);
+
+    float strongest = 0;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        if(params[i].strongest > strongest) strongest = params[i].strongest;
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = CORNER_SELECT;
+        params[i].floor = CORNER_QUALITY * strongest;
+    }
+    run_corner_phase(params);
+
+    //Each band already holds at most corner_count corners, strongest first.
+    unsigned long int total = 0;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++) total += params[i].count;
+    struct corner_point *points = malloc((total ? total : 1) * sizeof(struct corner_point));
+    total = 0;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        memcpy(points + total, params[i].points, params[i].count * sizeof(struct corner_point));
+        total += params[i].count;
+        free(params[i].points);
+    }
+    qsort(points, total, sizeof(struct corner_point), compare_corners);
+    *count = total < corner_count ? total : corner_count;
+    free(response);
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+    return points;
+}
+
+/* Write corners as a text point list: a header line, then "x y response" per corner, strongest first. */
+void write_corners(const struct corner_point *points, unsigned long int count, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return;
+    }
+    fprintf(fp, "# %s corners: x y response\n", corner_method_names[corner_method]);
+    for(unsigned long int i = 0; i < count; i++)
+    {
+        fprintf(fp, "%lu %lu %g\n", points[i].x, points[i].y, points[i].response);
+    }
+    fclose(fp);
+}
+
+/* Multi-channel images.
+ P7 (PAM) inputs may carry any number of 8-bit channels, e.g. 8 to 224 spectral bands. The pixels are kept
+ interleaved and the Laplacian is taken over whole rows of bytes: the neighbours of byte j are j - channels and
+ j + channels in the same row and j in the rows above and below, whatever the channel j belongs to, so the inner loop
+ runs over (w - 2) * channels bytes with no per-channel loop at all and vectorises across channels and pixels alike.
+ --channels selects the bands to keep; the others are dropped while the file is read and never filtered.
+ The result is written as laplaciani.pam with one channel per kept band.
+ */
+#define MAX_PAM_CHANNELS 1024
+
+struct multichannel_parameter {
+    const unsigned char *image;  //interleaved samples
+    unsigned char *result;
+    unsigned long int channels;
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int start;
+    unsigned long int size;
+};
+
+unsigned char channel_selected[MAX_PAM_CHANNELS];
+int channel_selection = 0;       //1 when --channels was given
+
+/* Parse a band list such as "0,3,5-7" into channel_selected.
+ Return: 0 on success, -1 otherwise.
+ */
+int parse_channel_list(const char *arg)
+{
+    const char *c = arg;
+    memset(channel_selected, 0, sizeof(channel_selected));
+    while(*c)
+    {
+        char *end;
+        long int first = strtol(c, &end, 10), last;
+        if(end == c || first < 0 || first >= MAX_PAM_CHANNELS) return -1;
+        last = first;
+        if(*end == '-')
+        {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if(end == c || last < first || last >= MAX_PAM_CHANNELS) return -1;
+        }
+        for(long int i = first; i <= last; i++) channel_selected[i] = 1;
+        c = end;
+        if(*c == ',') c++;
+        else if(*c) return -1;
+    }
+    channel_selection = 1;
+    return 0;
+}
+
+/* Open a P7 file, parse its header, and read the selected channels.
+ Return: the kept channels, interleaved, with their count in *channels and the tuple type in tupltype (empty when not
+ every channel was kept), or NULL with a message on stderr.
+ */
+unsigned char *read_pam(const char *filename, unsigned long int *width, unsigned long int *height, unsigned long int *channels, char *tupltype, size_t tupltype_size)
+{
+    char line[256], key[32];
+    unsigned long int depth = 0, maxval = 0;
+    FILE *fp = fopen(filename, "rb");
+    *width = *height = 0;
+    tupltype[0] = '\0';
+
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return NULL;
+    }
+    if(!fgets(line, sizeof(line), fp) || line[0] != 'P' || line[1] != '7')
+    {
+        fprintf(stderr, "Invalid image format error must be 'P7'\n");
+        fclose(fp);
+        return NULL;
+    }
+    while(fgets(line, sizeof(line), fp))
+    {
+        char value[200] = "";
+        if(line[0] == '#' || sscanf(line, "%31s %199[^\n]", key, value) < 1) continue;
+        if(strcmp(key, "ENDHDR") == 0) break;
+        if(strcmp(key, "WIDTH") == 0) *width = strtoul(value, NULL, 10);
+        else if(strcmp(key, "HEIGHT") == 0) *height = strtoul(value, NULL, 10);
+        else if(strcmp(key, "DEPTH") == 0) depth = strtoul(value, NULL, 10);
+        else if(strcmp(key, "MAXVAL") == 0) maxval = strtoul(value, NULL, 10);
+        else if(strcmp(key, "TUPLTYPE") == 0) snprintf(tupltype, tupltype_size, "%s", value);
+    }
+    if(*width == 0 || *height == 0 || depth == 0 || depth > MAX_PAM_CHANNELS || maxval != RGB_COMPONENT_COLOR)
+    {
+        fprintf(stderr, "'%s' needs a size, 1 to %d channels and MAXVAL 255\n", filename, MAX_PAM_CHANNELS);
+        fclose(fp);
+        return NULL;
+    }
+
+    unsigned long int kept[MAX_PAM_CHANNELS], count = 0;
+    for(unsigned long int c = 0; c < depth; c++)
+    {
+        if(!channel_selection || channel_selected[c]) kept[count++] = c;
+    }
+    if(count == 0)
+    {
+        fprintf(stderr, "None of the selected channels exist in '%s'\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    if(count != depth) tupltype[0] = '\0';
+
+    unsigned char *row = malloc(*width * depth);
+    unsigned char *img = malloc(*width * *height * count);
+    for(unsigned long int y = 0; y < *height; y++)
+    {
+        if(fread(row, *width * depth, 1, fp) != 1)
+        {
+            memset(row, 0, *width * depth);
+        }
+        unsigned char *dest = img + y * *width * count;
+        if(count == depth)
+        {
+            memcpy(dest, row, *width * depth);
+            continue;
+        }
+        for(unsigned long int x = 0; x < *width; x++)
+        {
+            for(unsigned long int k = 0; k < count; k++) dest[x * count + k] = row[x * depth + kept[k]];
+        }
+    }
+    free(row);
+    fclose(fp);
+    *channels = count;
+    return img;
+}
+
+void write_pam(const unsigned char *image, const char *filename, unsigned long int width, unsigned long int height, unsigned long int channels, const char *tupltype)
+{
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return;
+    }
+    fprintf(fp, "P7\nWIDTH %lu\nHEIGHT %lu\nDEPTH %lu\nMAXVAL %d\n", width, height, channels, RGB_COMPONENT_COLOR);
+    if(tupltype[0]) fprintf(fp, "TUPLTYPE %s\n", tupltype);
+    fprintf(fp, "ENDHDR\n");
+    fwrite(image, width * channels, height, fp);
+    fclose(fp);
+}
+
+/* This is the thread function for multi-channel images: the Laplacian of every channel on rows start to start+size. */
+void *compute_laplacian_multichannel_threadfn(void *params)
+{
+    struct multichannel_parameter *param = (struct multichannel_parameter *) params;
+    unsigned long int w = param->w, h = param->h, n = param->channels;
+    unsigned long int row_bytes = w * n;
+
+    for(unsigned long int y = param->start; y < param->start + param->size; y++)
+    {
+        const unsigned char *a = param->image + (y + h - 1) % h * row_bytes;
+        const unsigned char *b = param->image + y * row_bytes;
+        const unsigned char *c = param->image + (y + 1) % h * row_bytes;
+        unsigned char *out = param->result + y * row_bytes;
+
+        //Pixels 1 to w-2 of the row, all channels in one loop.
+        for(unsigned long int j = n; j + n < row_bytes; j++)
+        {
+            int sum = 8 * b[j] - a[j-n] - a[j] - a[j+n] - b[j-n] - b[j+n] - c[j-n] - c[j] - c[j+n];
+            out[j] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+        }
+
+        //The first and last pixels wrap around.
+        for(unsigned long int x = 0; x < w; x += (w > 1 ? w - 1 : 1))
+        {
+            unsigned long int l = (x + w - 1) % w * n, m = x * n, r = (x + 1) % w * n;
+            for(unsigned long int k = 0; k < n; k++)
+            {
+                int sum = 8 * b[m+k] - a[l+k] - a[m+k] - a[r+k] - b[l+k] - b[r+k] - c[l+k] - c[m+k] - c[r+k];
+                out[m+k] = clamp_pixel(sum);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Apply the Laplacian filter to every channel of an interleaved image using threads, split into bands like apply_filters.
+ Return: result (filtered image, same layout)
+ */
+unsigned char *apply_filters_multichannel(const unsigned char *image, unsigned long channels, unsigned long w, unsigned long h, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    unsigned char *result = malloc(w * h * channels);
+    struct multichannel_parameter params[LAPLACIAN_THREADS];
+    pthread_t t[LAPLACIAN_THREADS];
+    int work = h / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].image = image;
+        params[i].result = result;
+        params[i].channels = channels;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : work;
+        if(pthread_create(&t[i], NULL, compute_laplacian_multichannel_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(t[i], NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+    return result;
+}
+
+/* Read a PAM file, filter its selected channels and write laplaciani.pam. */
+void process_pam_file(const char *filename, int index)
+{
+    unsigned long int width, height, channels;
+    char tupltype[200];
+    char output_file_name[64];
+
+    unsigned char *img = read_pam(filename, &width, &height, &channels, tupltype, sizeof(tupltype));
+    if(!img)
+    {
+        return;
+    }
+    unsigned char *result = apply_filters_multichannel(img, channels, width, height, &total_elapsed_time);
+    snprintf(output_file_name, sizeof(output_file_name), "laplacian%d.pam", index);
+    write_pam(result, output_file_name, width, height, channels, tupltype);
+    free(result);
+    free(img);
+}
+
+/* Floating-point images.
+ PF (colour) and Pf (grey) inputs hold 32-bit float samples, e.g. radiance maps that would otherwise be quantised to
+ 8 bits first. They are filtered in float with no clamping and written as laplaciani.pfm. The rows are interleaved like
+ the multi-channel path, so one row kernel serves both PF and Pf; AVX2 and AVX-512 versions with FMA are compiled
+ alongside the scalar one and picked at startup from what the CPU supports (--float-isa overrides the choice).
+ All versions add the eight neighbours in the same order and fold in 8*centre with a single rounding, so they agree bit
+ for bit. With --half the image and the result are held as IEEE half floats, which halves the memory traffic of the
+ pass; samples are widened to float for the arithmetic. PFM stores its rows bottom to top; the Laplacian with
+ wraparound is symmetric in y, so the rows are filtered in file order and written back the same way.
+ */
+enum float_isa {ISA_SCALAR, ISA_AVX2, ISA_AVX512, ISA_COUNT};
+const char *float_isa_names[ISA_COUNT] = { "scalar", "avx2", "avx512" };
+
+struct float_parameter {
+    const void *image;       //float or half samples, interleaved
+    void *result;
+    unsigned long int channels;
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int start;
+    unsigned long int size;
+};
+
+int float_isa = -1;          //-1 until main picks the best the CPU supports
+int half_storage = 0;        //1 when --half was given
+
+/* Convert a float to an IEEE half, rounding to nearest even. */
+uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7fffff;
+    int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+
+    if(((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if(exponent >= 31) return sign | 0x7c00;
+    if(exponent <= 0)
+    {
+        //Subnormal half, or zero.
+        if(exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t h = mantissa >> shift, rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (h & 1))) h++;
+        return sign | h;
+    }
+    uint32_t h = ((uint32_t)exponent << 10) | (mantissa >> 13), rest = mantissa & 0x1fff;
+    //A carry out of the mantissa correctly rounds up into the next exponent, or to infinity.
+    if(rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff, x;
+    float f;
+
+    if(exponent == 0)
+    {
+        if(mantissa == 0) x = sign;
+        else
+        {
+            //Normalise the subnormal.
+            exponent = 1;
+            while(!(mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            x = sign | ((exponent + 112) << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    }
+    else if(exponent == 31) x = sign | 0x7f800000 | (mantissa << 13);
+    else x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+/* Open a PF or Pf file and read its samples, in file row order, converted to native byte order.
+ Return: the samples with the channel count in *channels, or NULL with a message on stderr.
+ */
+float *read_pfm(const char *filename, unsigned long int *width, unsigned long int *height, unsigned long int *channels)
+{
+    char magic[3];
+    double scale;
+    FILE *fp = fopen(filename, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return NULL;
+    }
+    if(fscanf(fp, "%2s %lu %lu %lf", magic, width, height, &scale) != 4 || magic[0] != 'P' || (magic[1] != 'F' && magic[1] != 'f') || *width == 0 || *height == 0 || scale == 0)
+    {
+        fprintf(stderr, "Invalid image format error must be 'PF' or 'Pf'\n");
+        fclose(fp);
+        return NULL;
+    }
+    fgetc(fp);
+    *channels = magic[1] == 'F' ? 3 : 1;
+
+    unsigned long int count = *width * *height * *channels;
+    float *img = malloc(count * sizeof(float));
+    if(fread(img, sizeof(float), count, fp) != count)
+    {
+        fprintf(stderr, "Error loading image '%s'\n", filename);
+        free(img);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    //A negative scale means little-endian samples.
+    uint16_t probe = 1;
+    int little = *(unsigned char *)&probe == 1;
+    if((scale < 0) != little)
+    {
+        uint32_t *words = (uint32_t *)img;
+        for(unsigned long int i = 0; i < count; i++) words[i] = __builtin_bswap32(words[i]);
+    }
+    return img;
+}
+
+void write_pfm(const float *image, const char *filename, unsigned long int width, unsigned long int height, unsigned long int channels)
+{
+    uint16_t probe = 1;
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return;
+    }
+    fprintf(fp, "P%c\n%lu %lu\n%s\n", channels == 3 ? 'F' : 'f', width, height, *(unsigned char *)&probe == 1 ? "-1.0" : "1.0");
+    fwrite(image, sizeof(float) * width * channels, height, fp);
+    fclose(fp);
+}
+
+/* Laplacian of samples start to end-1 of a row whose neighbours lie step elements to either side.
+ a, b and c are the rows above, at and below; the result goes to out.
+ */
+void laplacian_row_float(const float *a, const float *b, const float *c, float *out, unsigned long int start, unsigned long int end, unsigned long int step)
+{
+    for(unsigned long int j = start; j < end; j++)
+    {
+        float sum = a[j-step] + a[j] + a[j+step] + b[j-step] + b[j+step] + c[j-step] + c[j] + c[j+step];
+        out[j] = 8.0f * b[j] - sum;
+    }
+}
+
+void laplacian_row_half(const uint16_t *a, const uint16_t *b, const uint16_t *c, uint16_t *out, unsigned long int start, unsigned long int end, unsigned long int step)
+{
+    for(unsigned long int j = start; j < end; j++)
+    {
+        float sum = half_to_float(a[j-step]) + half_to_float(a[j]) + half_to_float(a[j+step]) + half_to_float(b[j-step])
+                  + half_to_float(b[j+step]) + half_to_float(c[j-step]) + half_to_float(c[j]) + half_to_float(c[j+step]);
+        out[j] = float_to_half(8.0f * half_to_float(b[j]) - sum);
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma")))
+void laplacian_row_float_avx2(const float *a, const float *b, const float *c, float *out, unsigned long int start, unsigned long int end, unsigned long int step)
+{
+    const __m256 eight = _mm256_set1_ps(8.0f);
+    unsigned long int j = start;
+    for(; j + 8 <= end; j += 8)
+    {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(a + j - step), _mm256_loadu_ps(a + j));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(a + j + step));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(b + j - step));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(b + j + step));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(c + j - step));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(c + j));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(c + j + step));
+        _mm256_storeu_ps(out + j, _mm256_fmsub_ps(eight, _mm256_loadu_ps(b + j), sum));
+    }
+    laplacian_row_float(a, b, c, out, j, end, step);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+void laplacian_row_half_avx2(const uint16_t *a, const uint16_t *b, const uint16_t *c, uint16_t *out, unsigned long int start, unsigned long int end, unsigned long int step)
+{
+    const __m256 eight = _mm256_set1_ps(8.0f);
+    unsigned long int j = start;
+#define LOAD_HALF(p) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(p)))
+    for(; j + 8 <= end; j += 8)
+    {
+        __m256 sum = _mm256_add_ps(LOAD_HALF(a + j - step), LOAD_HALF(a + j));
+        sum = _mm256_add_ps(sum, LOAD_HALF(a + j + step));
+        sum = _mm256_add_ps(sum, LOAD_HALF(b + j - step));
+        sum = _mm256_add_ps(sum, LOAD_HALF(b + j + step));
+        sum = _mm256_add_ps(sum, LOAD_HALF(c + j - step));
+        sum = _mm256_add_ps(sum, LOAD_HALF(c + j));
+        sum = _mm256_add_ps(sum, LOAD_HALF(c + j + step));
+        __m256 result = _mm256_fmsub_ps(eight, LOAD_HALF(b + j), sum);
+        _mm_storeu_si128((__m128i *)(out + j), _mm256_cvtps_ph(result, _MM_FROUND_TO_NEAREST_INT));
+    }
+#undef LOAD_HALF
+    laplacian_row_half(a, b, c, out, j, end, step);
+}
+
+__attribute__((target("avx512f")))
+void laplacian_row_float_avx512(const float *a, const float *b, const float *c, float *out, unsigned long int start, unsigned long int end, unsigned long int step)
+{
+    const __m512 eight = _mm512_set1_ps(8.0f);
+    unsigned long int j = start;
+    for(; j + 16 <= end; j += 16)
+    {
+        __m512 sum = _mm512_add_ps(_mm512_loadu_ps(a + j - step), _mm512_loadu_ps(a + j));
+        sum = _mm512_add_ps(sum, _mm512_loadu_ps(a + j + step));
+        sum = _mm512_add_ps(sum, _mm512_loadu_ps(b + j - step));
+        sum = _mm512_add_ps(sum, _mm512_loadu_ps(b + j + step));
+        sum = _mm512_add_ps(sum, _mm512_loadu_ps(c + j - step));
+        sum = _mm512_add_ps(sum, _mm512_loadu_ps(c + j));
+        sum = _mm512_add_ps(sum, _mm512_loadu_ps(c + j + step));
+        _mm512_storeu_ps(out + j, _mm512_fmsub_ps(eight, _mm512_loadu_ps(b + j), sum));
+    }
+    laplacian_row_float(a, b, c, out, j, end, step);
+}
+
+__attribute__((target("avx512f")))
+void laplacian_row_half_avx512(const uint16_t *a, const uint16_t *b, const uint16_t *c, uint16_t *out, unsigned long int start, unsigned long int end, unsigned long int step)
+{
+    const __m512 eight = _mm512_set1_ps(8.0f);
+    unsigned long int j = start;
+#define LOAD_HALF(p) _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(p)))
+    for(; j + 16 <= end; j += 16)
+    {
+        __m512 sum = _mm512_add_ps(LOAD_HALF(a + j - step), LOAD_HALF(a + j));
+        sum = _mm512_add_ps(sum, LOAD_HALF(a + j + step));
+        sum = _mm512_add_ps(sum, LOAD_HALF(b + j - step));
+        sum = _mm512_add_ps(sum, LOAD_HALF(b + j + step));
+        sum = _mm512_add_ps(sum, LOAD_HALF(c + j - step));
+        sum = _mm512_add_ps(sum, LOAD_HALF(c + j));
+        sum = _mm512_add_ps(sum, LOAD_HALF(c + j + step));
+        __m512 result = _mm512_fmsub_ps(eight, LOAD_HALF(b + j), sum);
+        _mm256_storeu_si256((__m256i *)(out + j), _mm512_cvtps_ph(result, _MM_FROUND_TO_NEAREST_INT));
+    }
+#undef LOAD_HALF
+    laplacian_row_half(a, b, c, out, j, end, step);
+}
+#endif
+
+/* Return: the widest row kernel this CPU can run. */
+int best_float_isa(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return ISA_AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) return ISA_AVX2;
+#endif
+    return ISA_SCALAR;
+}
+
+/* This is the thread function for float images: the Laplacian of every channel on rows start to start+size. */
+void *compute_laplacian_float_threadfn(void *params)
+{
+    struct float_parameter *param = (struct float_parameter *) params;
+    unsigned long int w = param->w, h = param->h, n = param->channels;
+    unsigned long int row = w * n;
+    void (*float_row)(const float *, const float *, const float *, float *, unsigned long int, unsigned long int, unsigned long int) = laplacian_row_float;
+    void (*half_row)(const uint16_t *, const uint16_t *, const uint16_t *, uint16_t *, unsigned long int, unsigned long int, unsigned long int) = laplacian_row_half;
+
+#if defined(__x86_64__)
+    if(float_isa == ISA_AVX512)
+    {
+        float_row = laplacian_row_float_avx512;
+        half_row = laplacian_row_half_avx512;
+    }
+    else if(float_isa == ISA_AVX2)
+    {
+        float_row = laplacian_row_float_avx2;
+        half_row = laplacian_row_half_avx2;
+    }
+#endif
+
+    for(unsigned long int y = param->start; y < param->start + param->size; y++)
+    {
+        unsigned long int above = (y + h - 1) % h * row, at = y * row, below = (y + 1) % h * row;
+
+        //Pixels 1 to w-2 through the row kernel, then the two wrapping pixels.
+        if(half_storage)
+        {
+            const uint16_t *image = param->image;
+            uint16_t *result = param->result;
+            if(w > 2) half_row(image + above, image + at, image + below, result + at, n, row - n, n);
+        }
+        else
+        {
+            const float *image = param->image;
+            float *result = param->result;
+            if(w > 2) float_row(image + above, image + at, image + below, result + at, n, row - n, n);
+        }
+        for(unsigned long int x = 0; x < w; x += (w > 1 ? w - 1 : 1))
+        {
+            unsigned long int l = (x + w - 1) % w * n, m = x * n, r = (x + 1) % w * n;
+            for(unsigned long int k = 0; k < n; k++)
+            {
+                unsigned long int offsets[9] = { above + l + k, above + m + k, above + r + k, at + l + k, at + r + k,
+                                                 below + l + k, below + m + k, below + r + k, at + m + k };
+                float v[9];
+                for(int i = 0; i < 9; i++)
+                {
+                    v[i] = half_storage ? half_to_float(((const uint16_t *)param->image)[offsets[i]]) : ((const float *)param->image)[offsets[i]];
+                }
+                float sum = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+                float value = 8.0f * v[8] - sum;
+                if(half_storage) ((uint16_t *)param->result)[at + m + k] = float_to_half(value);
+                else ((float *)param->result)[at + m + k] = value;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Apply the Laplacian filter to a float image using threads, split into bands like apply_filters.
+ The samples are float, or half floats when half_storage is set.
+ Return: result (filtered image, same layout and sample type)
+ */
+void *apply_filters_float(const void *image, unsigned long channels, unsigned long w, unsigned long h, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    void *result = malloc(w * h * channels * (half_storage ? sizeof(uint16_t) : sizeof(float)));
+    struct float_parameter params[LAPLACIAN_THREADS];
+    pthread_t t[LAPLACIAN_THREADS];
+    int work = h / LAPLACIAN_THREADS;
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].image = image;
+        params[i].result = result;
+        params[i].channels = channels;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : work;
+        if(pthread_create(&t[i], NULL, compute_laplacian_float_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(t[i], NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+    return result;
+}
+
+/* Read a PFM file, filter it in float (or half) and write laplaciani.pfm. */
+void process_pfm_file(const char *filename, int index)
+{
+    unsigned long int width, height, channels;
+    char output_file_name[64];
+
+    float *img = read_pfm(filename, &width, &height, &channels);
+    if(!img)
+    {
+        return;
+    }
+    unsigned long int count = width * height * channels;
+    void *input = img;
+    if(half_storage)
+    {
+        //Narrow once; the filter then reads and writes half the bytes.
+        uint16_t *narrow = malloc(count * sizeof(uint16_t));
+        for(unsigned long int i = 0; i < count; i++) narrow[i] = float_to_half(img[i]);
+        input = narrow;
+    }
+
+    void *result = apply_filters_float(input, channels, width, height, &total_elapsed_time);
+    if(half_storage)
+    {
+        for(unsigned long int i = 0; i < count; i++) img[i] = half_to_float(((uint16_t *)result)[i]);
+        free(input);
+        free(result);
+        result = img;
+        img = NULL;
+    }
+    snprintf(output_file_name, sizeof(output_file_name), "laplacian%d.pfm", index);
+    write_pfm(result, output_file_name, width, height, channels);
+    free(result);
+    free(img);
+}
+
+/* Distance transform.
+ -o distance writes, for every pixel, the Euclidean distance to the nearest pixel of the threshold mask, as used for
+ chamfer matching against the edges. It is exact, by the separable algorithm of Felzenszwalb and Huttenlocher: the
+ squared distance along each row, then the lower envelope of the parabolas rooted at those values down each column.
+ The row pass is split into bands like apply_filters; the column pass gives each thread a block of columns, gathered
+ EDT_COLUMN_BLOCK at a time so each read of the row pass results uses a whole cache line. Unlike the filters, distances
+ do not wrap around the image edges. Pixels of an image without any edge are infinitely far.
+ */
+#define EDT_COLUMN_BLOCK 8
+#define EDT_INFINITY 1e20        //squared distance standing for "no edge on this line"
+
+enum distance_phase { DISTANCE_ROWS, DISTANCE_COLUMNS };
+
+struct distance_parameter {
+    enum distance_phase phase;
+    const unsigned char *mask;   //edge pixels are non-zero
+    double *squared;             //squared distances along each row
+    float *result;
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int start;     //rows (DISTANCE_ROWS) or columns (DISTANCE_COLUMNS) start to start+size
+    unsigned long int size;
+};
+
+/* Squared distance transform of the samples f[0..n-1] into d: d[q] = min over p of (q-p)^2 + f[p].
+ v (n entries) and z (n+1 entries) are scratch space for the parabolas of the lower envelope and their boundaries.
+ */
+void distance_1d(const double *f, unsigned long int n, double *d, unsigned long int *v, double *z)
+{
+    long int k = 0;
+    v[0] = 0;
+    z[0] = -EDT_INFINITY;
+    z[1] = EDT_INFINITY;
+    for(unsigned long int q = 1; q < n; q++)
+    {
+        //Where the parabola of q overtakes the rightmost one kept so far; those it hides entirely are dropped.
+        //|s| stays below EDT_INFINITY / 2, so z[0] always stops the loop.
+        double s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+        while(s <= z[k])
+        {
+            k--;
+            s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = EDT_INFINITY;
+    }
+    k = 0;
+    for(unsigned long int q = 0; q < n; q++)
+    {
+        while(z[k+1] < q) k++;
+        d[q] = ((double)q - v[k]) * ((double)q - v[k]) + f[v[k]];
+    }
+}
+
+/* This is the thread function of the distance transform.
+ DISTANCE_ROWS: squared distances along rows start to start+size.
+ DISTANCE_COLUMNS: final distances of columns start to start+size.
+ */
+void *compute_distance_threadfn(void *params)
+{
+    struct distance_parameter *param = (struct distance_parameter *) params;
+    unsigned long int w = param->w, h = param->h;
+    unsigned long int n = w > h ? w : h;
+    double *f = malloc(EDT_COLUMN_BLOCK * n * sizeof(double));
+    double *d = malloc(n * sizeof(double));
+    double *z = malloc((n + 1) * sizeof(double));
+    unsigned long int *v = malloc(n * sizeof(unsigned long int));
+
+    if(param->phase == DISTANCE_ROWS)
+    {
+        for(unsigned long int y = param->start; y < param->start + param->size; y++)
+        {
+            for(unsigned long int x = 0; x < w; x++)
+            {
+                f[x] = param->mask[y * w + x] ? 0 : EDT_INFINITY;
+            }
+            distance_1d(f, w, param->squared + y * w, v, z);
+        }
+    }
+    else
+    {
+        for(unsigned long int x0 = param->start; x0 < param->start + param->size; x0 += EDT_COLUMN_BLOCK)
+        {
+            unsigned long int columns = param->start + param->size - x0;
+            if(columns > EDT_COLUMN_BLOCK) columns = EDT_COLUMN_BLOCK;
+            for(unsigned long int y = 0; y < h; y++)
+            {
+                for(unsigned long int c = 0; c < columns; c++) f[c * h + y] = param->squared[y * w + x0 + c];
+            }
+            for(unsigned long int c = 0; c < columns; c++)
+            {
+                distance_1d(f + c * h, h, d, v, z);
+                for(unsigned long int y = 0; y < h; y++)
+                {
+                    param->result[y * w + x0 + c] = d[y] >= EDT_INFINITY / 2 ? INFINITY : (float)sqrt(d[y]);
+                }
+            }
+        }
+    }
+    free(v);
+    free(z);
+    free(d);
+    free(f);
+    return NULL;
+}
+
+void run_distance_phase(struct distance_parameter *params, enum distance_phase phase, unsigned long int count)
+{
+    pthread_t threads[LAPLACIAN_THREADS];
+    int work = count / LAPLACIAN_THREADS;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = phase;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? count - params[i].start : (unsigned long int)work;
+        if(pthread_create(&threads[i], NULL, compute_distance_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Euclidean distance from every pixel to the nearest non-zero pixel of mask.
+ Return: result (one float per pixel, INFINITY if mask is empty)
+ */
+float *distance_transform(const unsigned char *mask, unsigned long int w, unsigned long int h, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    struct distance_parameter params[LAPLACIAN_THREADS];
+    double *squared = malloc(w * h * sizeof(double));
+    float *result = malloc(w * h * sizeof(float));
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].mask = mask;
+        params[i].squared = squared;
+        params[i].result = result;
+        params[i].w = w;
+        params[i].h = h;
+    }
+    run_distance_phase(params, DISTANCE_ROWS, h);
+    run_distance_phase(params, DISTANCE_COLUMNS, w);
+    free(squared);
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+    return result;
+}
+
+/* Write a distance image as PFM (float, rows bottom to top as the format wants) or as a 16-bit PGM of rounded
+ distances, saturated at 65535.
+ */
+void write_distance(const float *distance, const char *filename, unsigned long int width, unsigned long int height, enum output_format format)
+{
+    if(format == FORMAT_PFM)
+    {
+        float *flipped = malloc(width * height * sizeof(float));
+        for(unsigned long int y = 0; y < height; y++)
+        {
+            memcpy(flipped + y * width, distance + (height - 1 - y) * width, width * sizeof(float));
+        }
+        write_pfm(flipped, filename, width, height, 1);
+        free(flipped);
+        return;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return;
+    }
+    unsigned char *row = malloc(width * 2);
+    fprintf(fp, "P5\n%lu %lu\n65535\n", width, height);
+    for(unsigned long int y = 0; y < height; y++)
+    {
+        for(unsigned long int x = 0; x < width; x++)
+        {
+            float d = distance[y * width + x];
+            unsigned int v = d >= 65535 ? 65535 : (unsigned int)lroundf(d);
+            row[2*x] = v >> 8;
+            row[2*x+1] = v & 0xff;
+        }
+        fwrite(row, width * 2, 1, fp);
+    }
+    free(row);
+    fclose(fp);
+}
+
+/* Thinning.
+ -o thin reduces the threshold mask to one pixel wide lines with the Zhang-Suen algorithm. The mask is bit packed, 64
+ pixels per word, so all-background words are skipped at once; for every set pixel its eight neighbours form an 8-bit
+ code looked up in a table of the deletion rule of each of the two sub-iterations. Each sub-iteration marks the
+ deletions of all bands in parallel against the same state, then applies them. A row only needs to be looked at again
+ in a sub-iteration if it or a neighbouring row changed since it was last looked at in that sub-iteration, so the
+ work shrinks with the number of rows still changing. Pixels outside the image count as background.
+ */
+struct thin_state {
+    uint64_t *bits;              //the mask, words_per_row words per row, bit x%64 of word x/64 is pixel x
+    uint64_t *deleted;           //pixels deleted in the current sub-iteration, same layout
+    unsigned long int w;
+    unsigned long int h;
+    unsigned long int words_per_row;
+    long int *changed_at;        //per row: last step that deleted pixels in it
+    long int *checked_at[2];     //per row and sub-iteration: last step that looked at it
+    unsigned char rule[2][256];  //per sub-iteration and neighbourhood code: 1 if the pixel is deleted
+};
+
+struct thin_parameter {
+    struct thin_state *state;
+    long int step;               //steps count sub-iterations; step % 2 is the sub-iteration
+    unsigned long int start;
+    unsigned long int size;
+    unsigned long int rows_visited;
+};
+
+/* Fill the deletion tables. Code bit k is neighbour P(k+2) of Zhang-Suen: N, NE, E, SE, S, SW, W, NW. */
+void thin_rules(struct thin_state *state)
+{
+    for(int code = 0; code < 256; code++)
+    {
+        int p[8], neighbours = 0, transitions = 0;
+        for(int k = 0; k < 8; k++)
+        {
+            p[k] = (code >> k) & 1;
+            neighbours += p[k];
+        }
+        for(int k = 0; k < 8; k++)
+        {
+            if(!p[k] && p[(k + 1) % 8]) transitions++;
+        }
+        int keep = neighbours < 2 || neighbours > 6 || transitions != 1;
+        //First sub-iteration: N.E.S and E.S.W must be 0; second: N.E.W and N.S.W.
+        state->rule[0][code] = !keep && !(p[0] && p[2] && p[4]) && !(p[2] && p[4] && p[6]);
+        state->rule[1][code] = !keep && !(p[0] && p[2] && p[6]) && !(p[0] && p[4] && p[6]);
+    }
+}
+
+int thin_pixel(const struct thin_state *state, long int x, long int y)
+{
+    if(x < 0 || y < 0 || x >= (long int)state->w || y >= (long int)state->h) return 0;
+    return (state->bits[y * state->words_per_row + x / 64] >> (x % 64)) & 1;
+}
+
+/* This is the thread function of the thinning: mark the deletions of one sub-iteration on rows start to start+size. */
+void *compute_thin_threadfn(void *params)
+{
+    struct thin_parameter *param = (struct thin_parameter *) params;
+    struct thin_state *state = param->state;
+    int sub = param->step % 2;
+    const int dx[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+    const int dy[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+    param->rows_visited = 0;
+    for(unsigned long int y = param->start; y < param->start + param->size; y++)
+    {
+        uint64_t *deleted = state->deleted + y * state->words_per_row;
+        long int latest = state->changed_at[y];
+        if(y > 0 && state->changed_at[y-1] > latest) latest = state->changed_at[y-1];
+        if(y + 1 < state->h && state->changed_at[y+1] > latest) latest = state->changed_at[y+1];
+        memset(deleted, 0, state->words_per_row * sizeof(uint64_t));
+        if(latest < state->checked_at[sub][y]) continue;
+
+        state->checked_at[sub][y] = param->step;
+        param->rows_visited++;
+        for(unsigned long int i = 0; i < state->words_per_row; i++)
+        {
+            uint64_t word = state->bits[y * state->words_per_row + i];
+            while(word)
+            {
+                int bit = __builtin_ctzll(word);
+                long int x = i * 64 + bit;
+                int code = 0;
+                word &= word - 1;
+                for(int k = 0; k < 8; k++) code |= thin_pixel(state, x + dx[k], y + dy[k]) << k;
+                if(state->rule[sub][code]) deleted[i] |= (uint64_t)1 << bit;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Thin a mask (non-zero pixels are set) in place, to 255 on the lines and 0 elsewhere.
+ *steps gets the number of sub-iterations run, *rows_visited the rows looked at over all of them.
+ */
+void thin_mask(unsigned char *mask, unsigned long int w, unsigned long int h, int *steps, unsigned long int *rows_visited, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    struct thin_state state;
+    struct thin_parameter params[LAPLACIAN_THREADS];
+    pthread_t threads[LAPLACIAN_THREADS];
+    int work = h / LAPLACIAN_THREADS;
+
+    state.w = w;
+    state.h = h;
+    state.words_per_row = (w + 63) / 64;
+    state.bits = calloc(state.words_per_row * h, sizeof(uint64_t));
+    state.deleted = calloc(state.words_per_row * h, sizeof(uint64_t));
+    state.changed_at = calloc(h, sizeof(long int));
+    state.checked_at[0] = calloc(h, sizeof(long int));
+    state.checked_at[1] = calloc(h, sizeof(long int));
+    thin_rules(&state);
+    for(unsigned long int y = 0; y < h; y++)
+    {
+        //Every row is due in the first step of each sub-iteration.
+        state.changed_at[y] = -1;
+        state.checked_at[0][y] = state.checked_at[1][y] = -2;
+        for(unsigned long int x = 0; x < w; x++)
+        {
+            if(mask[y * w + x]) state.bits[y * state.words_per_row + x / 64] |= (uint64_t)1 << (x % 64);
+        }
+    }
+
+    *rows_visited = 0;
+    long int step, quiet = 0;
+    //Stop after two sub-iterations in a row deleted nothing.
+    for(step = 0; quiet < 2; step++)
+    {
+        for(int i = 0; i < LAPLACIAN_THREADS; i++)
+        {
+            params[i].state = &state;
+            params[i].step = step;
+            params[i].start = i * work;
+            //Making sure that the last thread take on the rest of the work
+            params[i].size = i == LAPLACIAN_THREADS - 1 ? h - params[i].start : (unsigned long int)work;
+            if(pthread_create(&threads[i], NULL, compute_thin_threadfn, (void*)&params[i]) != 0)
+            {
+                fprintf(stderr, "Unable to create thread %d\n", i);
+            }
+        }
+        for(int i = 0; i < LAPLACIAN_THREADS; i++)
+        {
+            pthread_join(threads[i], NULL);
+            *rows_visited += params[i].rows_visited;
+        }
+
+        int changed = 0;
+        for(unsigned long int y = 0; y < h; y++)
+        {
+            uint64_t any = 0;
+            for(unsigned long int i = 0; i < state.words_per_row; i++)
+            {
+                any |= state.deleted[y * state.words_per_row + i];
+                state.bits[y * state.words_per_row + i] &= ~state.deleted[y * state.words_per_row + i];
+            }
+            if(any)
+            {
+                state.changed_at[y] = step;
+                changed = 1;
+            }
+        }
+        quiet = changed ? 0 : quiet + 1;
+    }
+    *steps = step;
+
+    for(unsigned long int y = 0; y < h; y++)
+    {
+        for(unsigned long int x = 0; x < w; x++)
+        {
+            mask[y * w + x] = thin_pixel(&state, x, y) ? 255 : 0;
+        }
+    }
+    free(state.checked_at[1]);
+    free(state.checked_at[0]);
+    free(state.changed_at);
+    free(state.deleted);
+    free(state.bits);
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+}
+
+/* Histograms of oriented gradients.
+ --hog reuses the gradient the fused pass already computes: with it, the pass also keeps, for every pixel, the magnitude
+ and unsigned orientation (0 to 180 degrees) of the Sobel gradient of its strongest channel. The image is cut into
+ cells of hog_cell x hog_cell pixels (partial cells at the right and bottom edges are left out). Each thread builds the
+ HOG_BINS bin histograms of its own band of cell rows, splitting each pixel's magnitude between the two nearest bins,
+ so no histogram is shared between threads. Blocks of HOG_BLOCK x HOG_BLOCK cells, one cell apart, are then
+ normalised in parallel (L2-Hys: L2 norm, clipped at HOG_CLIP, L2 norm again) and written to hogi.bin:
+ a 32-byte header "HOG1" followed by seven 32-bit integers (cell size, cells across, cells down, bins, block size in
+ cells, blocks across, blocks down), then the block descriptors in row order, each HOG_BLOCK^2 cell histograms of
+ HOG_BINS 32-bit floats, all in the byte order of the machine that wrote them.
+ */
+#define HOG_BINS 9
+#define HOG_BLOCK 2
+#define HOG_CLIP 0.2f
+#define DEFAULT_HOG_CELL 8
+
+enum hog_phase { HOG_CELLS, HOG_BLOCKS };
+
+struct hog_parameter {
+    enum hog_phase phase;
+    const float *magnitude;
+    const float *orientation;
+    float *cells;                //cells_y x cells_x x HOG_BINS
+    float *blocks;               //blocks_y x blocks_x x HOG_BLOCK^2 x HOG_BINS
+    unsigned long int w;
+    unsigned long int cells_x;
+    unsigned long int cells_y;
+    unsigned long int start;     //cell rows (HOG_CELLS) or block rows (HOG_BLOCKS) start to start+size
+    unsigned long int size;
+};
+
+int hog_enabled = 0;
+int hog_cell = DEFAULT_HOG_CELL;
+
+/* This is the thread function of the HOG stage.
+ HOG_CELLS: the histograms of cell rows start to start+size.
+ HOG_BLOCKS: the normalised descriptors of block rows start to start+size.
+ */
+void *compute_hog_threadfn(void *params)
+{
+    struct hog_parameter *param = (struct hog_parameter *) params;
+    unsigned long int cells_x = param->cells_x;
+
+    if(param->phase == HOG_CELLS)
+    {
+        const float bin_width = 180.0f / HOG_BINS;
+        memset(param->cells + param->start * cells_x * HOG_BINS, 0, param->size * cells_x * HOG_BINS * sizeof(float));
+        for(unsigned long int y = param->start * hog_cell; y < (param->start + param->size) * hog_cell; y++)
+        {
+            float *row = param->cells + (y / hog_cell) * cells_x * HOG_BINS;
+            for(unsigned long int x = 0; x < cells_x * hog_cell; x++)
+            {
+                //Bin centres lie at (b + 0.5) * bin_width; the magnitude is split between the two around the orientation.
+                float position = param->orientation[y * param->w + x] / bin_width - 0.5f;
+                float m = param->magnitude[y * param->w + x];
+                int lower = (int)floorf(position);
+                float fraction = position - lower;
+                float *histogram = row + (x / hog_cell) * HOG_BINS;
+                histogram[(lower + HOG_BINS) % HOG_BINS] += m * (1 - fraction);
+                histogram[(lower + 1) % HOG_BINS] += m * fraction;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned long int blocks_x = cells_x - HOG_BLOCK + 1;
+    for(unsigned long int by = param->start; by < param->start + param->size; by++)
+    {
+        for(unsigned long int bx = 0; bx < blocks_x; bx++)
+        {
+            float *block = param->blocks + (by * blocks_x + bx) * HOG_BLOCK * HOG_BLOCK * HOG_BINS;
+            float sum = 0;
+            for(int cy = 0; cy < HOG_BLOCK; cy++)
+            {
+                for(int cx = 0; cx < HOG_BLOCK; cx++)
+                {
+                    memcpy(block + (cy * HOG_BLOCK + cx) * HOG_BINS, param->cells + ((by + cy) * cells_x + bx + cx) * HOG_BINS, HOG_BINS * sizeof(float));
+                }
+            }
+            for(int i = 0; i < HOG_BLOCK * HOG_BLOCK * HOG_BINS; i++) sum += block[i] * block[i];
+            float scale = 1 / sqrtf(sum + 1e-6f);
+            sum = 0;
+            for(int i = 0; i < HOG_BLOCK * HOG_BLOCK * HOG_BINS; i++)
+            {
+                block[i] *= scale;
+                if(block[i] > HOG_CLIP) block[i] = HOG_CLIP;
+                sum += block[i] * block[i];
+            }
+            scale = 1 / sqrtf(sum + 1e-6f);
+            for(int i = 0; i < HOG_BLOCK * HOG_BLOCK * HOG_BINS; i++) block[i] *= scale;
+        }
+    }
+    return NULL;
+}
+
+void run_hog_phase(struct hog_parameter *params, enum hog_phase phase, unsigned long int count)
+{
+    pthread_t threads[LAPLACIAN_THREADS];
+    int work = count / LAPLACIAN_THREADS;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = phase;
+        params[i].start = i * work;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? count - params[i].start : (unsigned long int)work;
+        if(pthread_create(&threads[i], NULL, compute_hog_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Build the HOG descriptors of an image from the gradient kept by the fused pass and write them to filename. */
+void write_hog(const float *magnitude, const float *orientation, unsigned long int w, unsigned long int h, const char *filename, double *elapsedTime)
+{
+    struct timeval start, end;
+    struct hog_parameter params[LAPLACIAN_THREADS];
+    unsigned long int cells_x = w / hog_cell, cells_y = h / hog_cell;
+    unsigned long int blocks_x = cells_x >= HOG_BLOCK ? cells_x - HOG_BLOCK + 1 : 0;
+    unsigned long int blocks_y = cells_y >= HOG_BLOCK ? cells_y - HOG_BLOCK + 1 : 0;
+    unsigned long int block_values = blocks_x * blocks_y * HOG_BLOCK * HOG_BLOCK * HOG_BINS;
+    gettimeofday(&start, NULL);
+
+    float *cells = malloc((cells_x * cells_y * HOG_BINS + 1) * sizeof(float));
+    float *blocks = malloc((block_values + 1) * sizeof(float));
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].magnitude = magnitude;
+        params[i].orientation = orientation;
+        params[i].cells = cells;
+        params[i].blocks = blocks;
+        params[i].w = w;
+        params[i].cells_x = cells_x;
+        params[i].cells_y = cells_y;
+    }
+    run_hog_phase(params, HOG_CELLS, cells_y);
+    if(blocks_x > 0)
+    {
+        run_hog_phase(params, HOG_BLOCKS, blocks_y);
+    }
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+    }
+    else
+    {
+        int32_t header[7] = { hog_cell, cells_x, cells_y, HOG_BINS, HOG_BLOCK, blocks_x, blocks_y };
+        fwrite("HOG1", 4, 1, fp);
+        fwrite(header, sizeof(header), 1, fp);
+        fwrite(blocks, sizeof(float), block_values, fp);
+        fclose(fp);
+    }
+    free(blocks);
+    free(cells);
+}
+
+/* Contours.
+ --contours writes the outlines of the threshold mask as closed polylines. They are traced by marching squares over the
+ cells between four pixel centres, with the image padded by background: a contour vertex is the midpoint of a cell
+ side whose two pixels differ, coordinates are kept in half pixels, and every side is crossed in one direction only,
+ foreground on the same hand, so each vertex has exactly one successor. Where a cell holds two contours, the pieces cut
+ off the background corners, keeping diagonal foreground connected.
+ Each thread takes a band of cell rows and records the successor of every vertex whose outgoing side lies in it. Then
+ it follows its own vertices: chains entering from another band run until they leave the band, and what is left
+ are loops closed within the band. The open chains of all bands are stitched end to start into the remaining contours.
+ Edge masks hold many speckles a few pixels across, so contours whose traced perimeter is below --contour-min-length
+ (default 16 pixels) are left out, and the rest are simplified with Douglas-Peucker at --contour-epsilon (default 1
+ pixel); 0 for both keeps every contour exactly.
+ Formats: json, {"width","height","contours":[[x0,y0,x1,y1,...],...]} in pixel units; bin, "CNT1" then unsigned LEB128
+ varints: width, height, number of contours, and per contour its number of points followed by the zigzag coded
+ first point and the differences between consecutive points, in half pixels.
+ */
+#define DEFAULT_CONTOUR_EPSILON 1.0     //pixels
+#define DEFAULT_CONTOUR_MIN_LENGTH 16.0 //pixels of perimeter
+
+enum contour_format {CONTOUR_JSON, CONTOUR_BIN, CONTOUR_FORMAT_COUNT};
+const char *contour_format_names[CONTOUR_FORMAT_COUNT] = { "json", "bin" };
+
+enum contour_phase { CONTOUR_SEGMENTS, CONTOUR_TRACE };
+
+/* Closed polylines, x and y in half pixels: contour k is the pairs starts[k] to starts[k+1]. */
+struct contour_set {
+    struct int_list coords;
+    struct int_list starts;
+    unsigned long int dropped;   //contours shorter than contour_min_length, left out
+};
+
+/* A piece of contour running through one band: vertices from start, which is entered from another band, to end, in the next. */
+struct contour_chain {
+    int32_t start;
+    int32_t end;
+    unsigned long int first;     //vertices first to first+count of the band's chain_vertices
+    unsigned long int count;
+    const int32_t *vertices;     //set once the band is traced
+};
+
+struct contour_parameter {
+    enum contour_phase phase;
+    const unsigned char *mask;
+    unsigned long int w;
+    unsigned long int h;
+    long int start;              //cell rows start to start+size; cell row y lies between pixel rows y and y+1
+    long int size;
+    int band;                    //1-based, as stored in owner and predecessor
+    int32_t *successor;          //per vertex: the next vertex along its contour
+    unsigned char *owner;        //per vertex: band holding its outgoing side, 0 for none
+    unsigned char *predecessor;  //per vertex: band holding its incoming side
+    unsigned char *visited;
+    struct int_list owned;       //vertices of this band
+    struct int_list chain_vertices;
+    struct contour_chain *chains;
+    unsigned long int chain_count;
+    struct contour_set loops;    //contours closed within the band
+};
+
+int contours_enabled = 0;
+enum contour_format contour_format = CONTOUR_BIN;
+double contour_epsilon = DEFAULT_CONTOUR_EPSILON;
+double contour_min_length = DEFAULT_CONTOUR_MIN_LENGTH;
+
+/* Mark the points of coords[first..last] (pairs) that Douglas-Peucker keeps between the two ends, in keep. */
+void simplify_polyline(const int32_t *coords, unsigned long int first, unsigned long int last, double epsilon, unsigned char *keep)
+{
+    while(last > first + 1)
+    {
+        double ax = coords[2*first], ay = coords[2*first+1], bx = coords[2*last], by = coords[2*last+1];
+        double dx = bx - ax, dy = by - ay, length = sqrt(dx * dx + dy * dy);
+        double farthest = -1;
+        unsigned long int split = first;
+        for(unsigned long int i = first + 1; i < last; i++)
+        {
+            double px = coords[2*i] - ax, py = coords[2*i+1] - ay;
+            double d = length > 0 ? fabs(px * dy - py * dx) / length : sqrt(px * px + py * py);
+            if(d > farthest)
+            {
+                farthest = d;
+                split = i;
+            }
+        }
+        if(farthest <= epsilon) return;
+        keep[split] = 1;
+        simplify_polyline(coords, first, split, epsilon, keep);
+        first = split;
+    }
+}
+
+/* Append a closed contour given as vertex ids to set, simplified with contour_epsilon, unless it is shorter than
+ contour_min_length.
+ */
+void add_contour(struct contour_set *set, const int32_t *vertices, unsigned long int n, unsigned long int w)
+{
+    long int row = 2 * w + 3;
+    int32_t *coords = malloc(2 * (n + 1) * sizeof(int32_t));
+    double length = 0;
+    for(unsigned long int i = 0; i <= n; i++)
+    {
+        //The last point repeats the first, closing the loop.
+        int32_t v = vertices[i % n];
+        coords[2*i] = v % row - 2;
+        coords[2*i+1] = v / row - 2;
+        if(i > 0) length += hypot(coords[2*i] - coords[2*i-2], coords[2*i+1] - coords[2*i-1]);
+    }
+    //Lengths are in half pixels.
+    if(length < 2 * contour_min_length)
+    {
+        set->dropped++;
+        free(coords);
+        return;
+    }
+    unsigned char *keep = calloc(n + 1, 1);
+
+    //Split the loop at its first point and the point farthest from it, and simplify both halves.
+    unsigned long int far = 0;
+    double farthest = -1;
+    for(unsigned long int i = 1; i < n; i++)
+    {
+        double dx = coords[2*i] - coords[0], dy = coords[2*i+1] - coords[1];
+        if(dx * dx + dy * dy > farthest)
+        {
+            farthest = dx * dx + dy * dy;
+            far = i;
+        }
+    }
+    keep[0] = keep[far] = 1;
+    simplify_polyline(coords, 0, far, 2 * contour_epsilon, keep);
+    simplify_polyline(coords, far, n, 2 * contour_epsilon, keep);
+
+    int_list_push(&set->starts, set->coords.count / 2);
+    for(unsigned long int i = 0; i < n; i++)
+    {
+        if(!keep[i]) continue;
+        int_list_push(&set->coords, coords[2*i]);
+        int_list_push(&set->coords, coords[2*i+1]);
+    }
+    free(keep);
+    free(coords);
+}
+
+/* This is the thread function of the contour tracer, for cell rows start to start+size.
+ CONTOUR_SEGMENTS: the successor of every vertex whose outgoing side lies in the band.
+ CONTOUR_TRACE: the open chains and closed loops of the band.
+ */
+void *compute_contours_threadfn(void *params)
+{
+    struct contour_parameter *param = (struct contour_parameter *) params;
+    long int w = param->w, h = param->h, row = 2 * w + 3;
+
+    if(param->phase == CONTOUR_SEGMENTS)
+    {
+        //For each cell case: up to two pieces, from side to side (0 top, 1 right, 2 bottom, 3 left); corners clockwise from top left.
+        int pieces[16][4];
+        for(int c = 0; c < 16; c++)
+        {
+            int n = 0;
+            for(int k = 0; k < 4; k++)
+            {
+                //A piece starts where the sides, walked clockwise, go from background into foreground, and ends at the
+                //first foreground to background side counterclockwise from there, cutting off the background corner.
+                if(((c >> k) & 1) || !((c >> ((k + 1) % 4)) & 1)) continue;
+                int j = (k + 3) % 4;
+                while(!(((c >> j) & 1) && !((c >> ((j + 1) % 4)) & 1))) j = (j + 3) % 4;
+                pieces[c][n++] = k;
+                pieces[c][n++] = j;
+            }
+            for(; n < 4; n++) pieces[c][n] = -1;
+        }
+
+        for(long int y = param->start; y < param->start + param->size; y++)
+        {
+            for(long int x = -1; x < w; x++)
+            {
+                int corner[4] = { 0, 0, 0, 0 };
+                if(y >= 0 && x >= 0) corner[0] = param->mask[y * w + x] != 0;
+                if(y >= 0 && x + 1 < w) corner[1] = param->mask[y * w + x + 1] != 0;
+                if(y + 1 < h && x + 1 < w) corner[2] = param->mask[(y + 1) * w + x + 1] != 0;
+                if(y + 1 < h && x >= 0) corner[3] = param->mask[(y + 1) * w + x] != 0;
+                int c = corner[0] | corner[1] << 1 | corner[2] << 2 | corner[3] << 3;
+                if(c == 0 || c == 15) continue;
+
+                //Side midpoints in half pixels, offset by 2 so the padding cells stay positive.
+                int32_t side[4] = { (2*y + 2) * row + 2*x + 3, (2*y + 3) * row + 2*x + 4, (2*y + 4) * row + 2*x + 3, (2*y + 3) * row + 2*x + 2 };
+                for(int p = 0; p < 4 && pieces[c][p] >= 0; p += 2)
+                {
+                    int32_t from = side[pieces[c][p]], to = side[pieces[c][p+1]];
+                    param->successor[from] = to;
+                    param->owner[from] = param->band;
+                    param->predecessor[to] = param->band;
+                    int_list_push(&param->owned, from);
+                }
+            }
+        }
+        return NULL;
+    }
+
+    unsigned long int capacity = 16;
+    struct int_list loop = { 0 };
+    param->chains = malloc(capacity * sizeof(struct contour_chain));
+    param->chain_count = 0;
+    for(unsigned long int i = 0; i < param->owned.count; i++)
+    {
+        int32_t v = param->owned.items[i];
+        if(param->predecessor[v] == param->band) continue;
+
+        //Entered from another band: follow the chain until it leaves this one.
+        if(param->chain_count == capacity)
+        {
+            capacity *= 2;
+            param->chains = realloc(param->chains, capacity * sizeof(struct contour_chain));
+        }
+        struct contour_chain *chain = &param->chains[param->chain_count++];
+        chain->start = v;
+        chain->first = param->chain_vertices.count;
+        while(param->owner[v] == param->band)
+        {
+            param->visited[v] = 1;
+            int_list_push(&param->chain_vertices, v);
+            v = param->successor[v];
+        }
+        chain->end = v;
+        chain->count = param->chain_vertices.count - chain->first;
+    }
+    for(unsigned long int i = 0; i < param->owned.count; i++)
+    {
+        int32_t v = param->owned.items[i];
+        if(param->visited[v]) continue;
+        loop.count = 0;
+        while(!param->visited[v])
+        {
+            param->visited[v] = 1;
+            int_list_push(&loop, v);
+            v = param->successor[v];
+        }
+        add_contour(&param->loops, loop.items, loop.count, w);
+    }
+    free(loop.items);
+    return NULL;
+}
+
+void run_contour_phase(struct contour_parameter *params, enum contour_phase phase)
+{
+    pthread_t threads[LAPLACIAN_THREADS];
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        params[i].phase = phase;
+        if(pthread_create(&threads[i], NULL, compute_contours_threadfn, (void*)&params[i]) != 0)
+        {
+            fprintf(stderr, "Unable to create thread %d\n", i);
+        }
+    }
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int compare_chain_starts(const void *a, const void *b)
+{
+    const struct contour_chain *const *p = a, *const *q = b;
+    return ((*p)->start > (*q)->start) - ((*p)->start < (*q)->start);
+}
+
+/* Trace the contours of a mask (non-zero pixels are set).
+ Return: the contours, in one set
+ */
+struct contour_set trace_contours(const unsigned char *mask, unsigned long int w, unsigned long int h, double *elapsedTime)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    struct contour_parameter params[LAPLACIAN_THREADS];
+    unsigned long int vertices = (2 * w + 3) * (2 * h + 3);
+    int32_t *successor = malloc(vertices * sizeof(int32_t));
+    unsigned char *owner = calloc(vertices, 1);
+    unsigned char *predecessor = calloc(vertices, 1);
+    unsigned char *visited = calloc(vertices, 1);
+    long int cell_rows = h + 1, work = cell_rows / LAPLACIAN_THREADS;
+    struct contour_set contours = { { 0 }, { 0 }, 0 };
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        memset(&params[i], 0, sizeof(params[i]));
+        params[i].mask = mask;
+        params[i].w = w;
+        params[i].h = h;
+        params[i].start = i * work - 1;
+        //Making sure that the last thread take on the rest of the work
+        params[i].size = i == LAPLACIAN_THREADS - 1 ? cell_rows - i * work : work;
+        params[i].band = i + 1;
+        params[i].successor = successor;
+        params[i].owner = owner;
+        params[i].predecessor = predecessor;
+        params[i].visited = visited;
+    }
+    run_contour_phase(params, CONTOUR_SEGMENTS);
+    run_contour_phase(params, CONTOUR_TRACE);
+
+    //Stitch the open chains: each ends where exactly one other starts.
+    unsigned long int chain_count = 0;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++) chain_count += params[i].chain_count;
+    struct contour_chain **chains = malloc((chain_count + 1) * sizeof(struct contour_chain *));
+    chain_count = 0;
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        for(unsigned long int c = 0; c < params[i].chain_count; c++)
+        {
+            params[i].chains[c].vertices = params[i].chain_vertices.items + params[i].chains[c].first;
+            chains[chain_count++] = &params[i].chains[c];
+        }
+    }
+    qsort(chains, chain_count, sizeof(struct contour_chain *), compare_chain_starts);
+
+    struct int_list stitched = { 0 };
+    unsigned char *used = calloc(chain_count + 1, 1);
+    for(unsigned long int c = 0; c < chain_count; c++)
+    {
+        if(used[c]) continue;
+        stitched.count = 0;
+        unsigned long int current = c;
+        while(!used[current])
+        {
+            used[current] = 1;
+            for(unsigned long int k = 0; k < chains[current]->count; k++) int_list_push(&stitched, chains[current]->vertices[k]);
+            struct contour_chain key = { chains[current]->end, 0, 0, 0, NULL }, *key_pointer = &key;
+            struct contour_chain **next = bsearch(&key_pointer, chains, chain_count, sizeof(struct contour_chain *), compare_chain_starts);
+            current = next - chains;
+        }
+        add_contour(&contours, stitched.items, stitched.count, w);
+    }
+    free(stitched.items);
+    free(used);
+    free(chains);
+
+    for(int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        struct contour_set *loops = &params[i].loops;
+        contours.dropped += loops->dropped;
+        for(unsigned long int k = 0; k < loops->starts.count; k++)
+        {
+            int_list_push(&contours.starts, contours.coords.count / 2 + loops->starts.items[k]);
+        }
+        for(unsigned long int k = 0; k < loops->coords.count; k++) int_list_push(&contours.coords, loops->coords.items[k]);
+        free(loops->coords.items);
+        free(loops->starts.items);
+        free(params[i].owned.items);
+        free(params[i].chain_vertices.items);
+        free(params[i].chains);
+    }
+    free(visited);
+    free(predecessor);
+    free(owner);
+    free(successor);
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&mutex_c);
+    *elapsedTime += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    pthread_mutex_unlock(&mutex_c);
+    return contours;
+}
+
+void write_varint(FILE *fp, uint64_t value, unsigned long int *bytes)
+{
+    do
+    {
+        fputc((int)(value & 0x7f) | (value > 0x7f ? 0x80 : 0), fp);
+        (*bytes)++;
+        value >>= 7;
+    } while(value);
+}
+
+void write_zigzag(FILE *fp, int64_t value, unsigned long int *bytes)
+{
+    write_varint(fp, value < 0 ? ((uint64_t)(-(value + 1)) << 1) | 1 : (uint64_t)value << 1, bytes);
+}
+
+/* Write the contours to filename in format.
+ Return: the size of the file in bytes
+ */
+unsigned long int write_contours(const struct contour_set *contours, const char *filename, enum contour_format format, unsigned long int w, unsigned long int h)
+{
+    FILE *fp = fopen(filename, "wb");
+    unsigned long int bytes = 0;
+    if(fp == NULL)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return 0;
+    }
+    unsigned long int count = contours->starts.count;
+    if(format == CONTOUR_BIN)
+    {
+        fwrite("CNT1", 1, 4, fp);
+        bytes = 4;
+        write_varint(fp, w, &bytes);
+        write_varint(fp, h, &bytes);
+        write_varint(fp, count, &bytes);
+    }
+    else
+    {
+        bytes += fprintf(fp, "{\"width\":%lu,\"height\":%lu,\"contours\":[", w, h);
+    }
+    for(unsigned long int k = 0; k < count; k++)
+    {
+        unsigned long int first = contours->starts.items[k];
+        unsigned long int last = k + 1 < count ? (unsigned long int)contours->starts.items[k + 1] : contours->coords.count / 2;
+        const int32_t *coords = contours->coords.items;
+        if(format == CONTOUR_BIN)
+        {
+            int32_t x = 0, y = 0;
+            write_varint(fp, last - first, &bytes);
+            for(unsigned long int i = first; i < last; i++)
+            {
+                write_zigzag(fp, coords[2*i] - x, &bytes);
+                write_zigzag(fp, coords[2*i+1] - y, &bytes);
+                x = coords[2*i];
+                y = coords[2*i+1];
+            }
+        }
+        else
+        {
+            bytes += fprintf(fp, k ? ",[" : "[");
+            for(unsigned long int i = first; i < last; i++)
+            {
+                bytes += fprintf(fp, "%s%g,%g", i > first ? "," : "", coords[2*i] / 2.0, coords[2*i+1] / 2.0);
+            }
+            bytes += fprintf(fp, "]");
+        }
+    }
+    if(format == CONTOUR_JSON)
+    {
+        bytes += fprintf(fp, "]}\n");
+    }
+    fclose(fp);
+    return bytes;
+}
+
+/* Run-length encoded masks.
+ -o threshold:rle and -o thin:rle write a mask as "RLE2", unsigned LEB128 varints for the width and height, and a coding
+ byte. The runs alternate between off and on pixels in scanline order, starting with off, and add up to width * height.
+ Edge masks have runs of a few pixels, where a byte per run loses to packing the mask eight pixels to a byte, so runs
+ are Exp-Golomb bit codes: the first run, which may be empty, as it is and every other run less one, with one order
+ for off runs and one for on runs, each the order giving the fewest bits for its runs.
+ Coding 1: the number of runs as a varint, the off and on orders as two bytes, then the codes, most significant bit
+ first. Coding 0: when that would not be smaller, the mask packed eight pixels to a byte, most significant bit first.
+ The threshold runs come straight out of the fused pass, each band encoding its own rows. An RLE file given as input
+ is decoded into the mask, and the stages that start from the mask (threshold, thin, distance and contours) run on it.
+ */
+#define RLE_MAX_ORDER 24
+
+enum rle_coding { RLE_PACKED, RLE_EXP_GOLOMB, RLE_CODING_COUNT };
+const char *rle_coding_names[RLE_CODING_COUNT] = { "bit-packed", "exp-golomb" };
+
+/* Bits written to or read from a file, most significant first. */
+struct bit_stream {
+    FILE *fp;
+    uint64_t bits;
+    int count;                   //bits held in bits, not yet written or not yet read
+    unsigned long int bytes;     //bytes written
+};
+
+/* Write the n (at most 32) low bits of value. */
+void put_bits(struct bit_stream *s, uint64_t value, int n)
+{
+    s->bits = (s->bits << n) | (value & ((1ULL << n) - 1));
+    s->count += n;
+    while(s->count >= 8)
+    {
+        s->count -= 8;
+        fputc((int)(s->bits >> s->count) & 0xff, s->fp);
+        s->bytes++;
+    }
+}
+
+/* Pad the last byte with zeros. */
+void flush_bits(struct bit_stream *s)
+{
+    if(s->count > 0) put_bits(s, 0, 8 - s->count);
+}
+
+/* Return: the next bit, or -1 at the end of the file. */
+int get_bit(struct bit_stream *s)
+{
+    if(s->count == 0)
+    {
+        int c = fgetc(s->fp);
+        if(c == EOF) return -1;
+        s->bits = c;
+        s->count = 8;
+    }
+    s->count--;
+    return (s->bits >> s->count) & 1;
+}
+
+int bit_length(uint64_t value)
+{
+    return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+unsigned long int exp_golomb_bits(uint64_t value, int order)
+{
+    return 2 * bit_length((value >> order) + 1) + order - 1;
+}
+
+/* Write value + 2^order in binary, preceded by one zero for every bit it has beyond order + 1. */
+void put_exp_golomb(struct bit_stream *s, uint64_t value, int order)
+{
+    uint64_t x = value + (1ULL << order);
+    int n = bit_length(x);
+    put_bits(s, 0, n - order - 1);
+    put_bits(s, x, n);
+}
+
+/* Return: 0 on success, -1 at the end of the file or on a code too long to be a run. */
+int get_exp_golomb(struct bit_stream *s, int order, uint64_t *value)
+{
+    int zeros = 0, bit;
+    while((bit = get_bit(s)) == 0)
+    {
+        if(++zeros > 32) return -1;
+    }
+    if(bit < 0) return -1;
+    uint64_t x = 1;
+    for(int i = 0; i < zeros + order; i++)
+    {
+        if((bit = get_bit(s)) < 0) return -1;
+        x = (x << 1) | bit;
+    }
+    *value = x - (1ULL << order);
+    return 0;
+}
+
+/* The value run k is coded as: runs other than the first are never empty. */
+uint64_t run_code_value(const struct int_list *runs, unsigned long int k)
+{
+    return k == 0 ? (uint32_t)runs->items[0] : (uint32_t)runs->items[k] - 1;
+}
+
+unsigned long int varint_size(uint64_t value)
+{
+    unsigned long int bytes = 1;
+    while(value >= 0x80)
+    {
+        value >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+int mask_runs_file(const char *filename)
+{
+    char magic[4];
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    int found = fread(magic, 4, 1, fp) == 1 && memcmp(magic, "RLE2", 4) == 0;
+    fclose(fp);
+    return found;
+}
+
+/* Write runs, the run lengths of a width x height mask, to filename, in whichever coding is smaller.
+ Return: the size of the file in bytes, with the coding used in *coding
+ */
+unsigned long int write_mask_runs(const struct int_list *runs, const char *filename, unsigned long int width, unsigned long int height, enum rle_coding *coding)
+{
+    struct bit_stream s = { 0 };
+    s.bytes = 5;
+    s.fp = fopen(filename, "wb");
+    if(s.fp == NULL)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return 0;
+    }
+
+    //The exact size of every order, for off runs (0) and on runs (1).
+    unsigned long int cost[2][RLE_MAX_ORDER + 1] = { { 0 } };
+    for(unsigned long int k = 0; k < runs->count; k++)
+    {
+        uint64_t value = run_code_value(runs, k);
+        for(int order = 0; order <= RLE_MAX_ORDER; order++) cost[k % 2][order] += exp_golomb_bits(value, order);
+    }
+    int orders[2] = { 0, 0 };
+    for(int side = 0; side < 2; side++)
+    {
+        for(int order = 1; order <= RLE_MAX_ORDER; order++)
+        {
+            if(cost[side][order] < cost[side][orders[side]]) orders[side] = order;
+        }
+    }
+    unsigned long int coded = varint_size(runs->count) + 2 + (cost[0][orders[0]] + cost[1][orders[1]] + 7) / 8;
+    *coding = coded < (width * height + 7) / 8 ? RLE_EXP_GOLOMB : RLE_PACKED;
+
+    fwrite("RLE2", 1, 4, s.fp);
+    write_varint(s.fp, width, &s.bytes);
+    write_varint(s.fp, height, &s.bytes);
+    fputc(*coding, s.fp);
+    if(*coding == RLE_EXP_GOLOMB)
+    {
+        write_varint(s.fp, runs->count, &s.bytes);
+        fputc(orders[0], s.fp);
+        fputc(orders[1], s.fp);
+        s.bytes += 2;
+        for(unsigned long int k = 0; k < runs->count; k++) put_exp_golomb(&s, run_code_value(runs, k), orders[k % 2]);
+    }
+    else
+    {
+        for(unsigned long int k = 0; k < runs->count; k++)
+        {
+            uint64_t pixels = (uint32_t)runs->items[k], fill = k % 2 ? 0xffffffffu : 0;
+            for(; pixels >= 32; pixels -= 32) put_bits(&s, fill, 32);
+            put_bits(&s, fill, (int)pixels);
+        }
+    }
+    flush_bits(&s);
+    fclose(s.fp);
+    return s.bytes;
+}
+
+int read_varint(FILE *fp, uint64_t *value)
+{
+    int c, shift = 0;
+    *value = 0;
+    do
+    {
+        c = fgetc(fp);
+        if(c == EOF || shift > 63) return -1;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+    return 0;
+}
+
+/* Open an RLE mask file and decode it.
+ Return: the mask, one byte per pixel (0 or 255), or NULL if the file is not a valid RLE mask
+ */
+unsigned char *read_mask_runs(const char *filename, unsigned long int *width, unsigned long int *height)
+{
+    char magic[4];
+    uint64_t w, h, count = 0, length, filled = 0;
+    int coding, orders[2] = { 0, 0 };
+    struct bit_stream s = { 0 };
+    s.fp = fopen(filename, "rb");
+    if(s.fp == NULL)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return NULL;
+    }
+    if(fread(magic, 4, 1, s.fp) != 1 || memcmp(magic, "RLE2", 4) != 0 || read_varint(s.fp, &w) || read_varint(s.fp, &h)
+       || w == 0 || h == 0 || w > (1UL << 31) / h || (coding = fgetc(s.fp)) < 0 || coding >= RLE_CODING_COUNT
+       || (coding == RLE_EXP_GOLOMB && (read_varint(s.fp, &count) || (orders[0] = fgetc(s.fp)) < 0 || orders[0] > RLE_MAX_ORDER
+                                        || (orders[1] = fgetc(s.fp)) < 0 || orders[1] > RLE_MAX_ORDER)))
+    {
+        fprintf(stderr, "Invalid RLE mask header in '%s'\n", filename);
+        fclose(s.fp);
+        return NULL;
+    }
+
+    unsigned char *mask = malloc(w * h);
+    if(coding == RLE_PACKED)
+    {
+        for(filled = 0; filled < w * h; filled++)
+        {
+            int bit = get_bit(&s);
+            if(bit < 0) break;
+            mask[filled] = bit ? 255 : 0;
+        }
+    }
+    for(uint64_t k = 0; k < count; k++)
+    {
+        int invalid = get_exp_golomb(&s, orders[k % 2], &length);
+        if(k > 0) length++;
+        if(invalid || length > w * h - filled)
+        {
+            fprintf(stderr, "Invalid run %lu in '%s'\n", (unsigned long int)k, filename);
+            free(mask);
+            fclose(s.fp);
+            return NULL;
+        }
+        memset(mask + filled, k % 2 ? 255 : 0, length);
+        filled += length;
+    }
+    fclose(s.fp);
+    if(filled != w * h)
+    {
+        fprintf(stderr, "The runs of '%s' cover %lu of %lu pixels\n", filename, (unsigned long int)filled, (unsigned long int)(w * h));
+        free(mask);
+        return NULL;
+    }
+    *width = w;
+    *height = h;
+    return mask;
+}
+
+/* Return: the second byte of the file's magic number, e.g. '6' for P6, or 0 if it cannot be read. */
+int image_magic(const char *filename)
+{
+    unsigned char magic[2] = { 0, 0 };
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    if(fread(magic, 2, 1, fp) != 1 || magic[0] != 'P') magic[1] = 0;
+    fclose(fp);
+    return magic[1];
+}
+
+/* Heatmap summaries.
+ --heatmap[=CxR] writes the density of edge pixels (those the threshold mask turns on) over a grid of C x R cells,
+ 32x32 by default, for dashboards that only need a coarse view. The counts are taken by the fused pass: every thread
+ fills a grid of its own, uniform tiles add all their pixels at once, and the grids are summed after the join.
+ heatmapi.pgm holds 0 to 255 for no to all pixels of a cell; heatmapi.csv (--heatmap-format=csv) holds R lines of C
+ fractions. Without -o, the heatmap is the only output.
+ */
+enum heatmap_format {HEATMAP_PGM, HEATMAP_CSV, HEATMAP_FORMAT_COUNT};
+const char *heatmap_format_names[HEATMAP_FORMAT_COUNT] = { "pgm", "csv" };
+
+int heatmap_enabled = 0;
+int heatmap_columns = 32;
+int heatmap_rows = 32;
+enum heatmap_format heatmap_format = HEATMAP_PGM;
+
+/* Write the heatmap counted into out for a width x height image to filename. */
+void write_heatmap(const struct filter_outputs *out, unsigned long int width, unsigned long int height, const char *filename)
+{
+    int columns = out->heatmap_columns, rows = out->heatmap_rows;
+    unsigned long int *cell_width = calloc(columns, sizeof(unsigned long int));
+    unsigned long int *cell_height = calloc(rows, sizeof(unsigned long int));
+    double *density = malloc(columns * rows * sizeof(double));
+    for(unsigned long int x = 0; x < width; x++) cell_width[out->heat_column[x]]++;
+    for(unsigned long int y = 0; y < height; y++) cell_height[y * rows / height]++;
+    for(int r = 0; r < rows; r++)
+    {
+        for(int c = 0; c < columns; c++) density[r * columns + c] = (double)out->heatmap[r * columns + c] / (cell_width[c] * cell_height[r]);
+    }
+
+    if(heatmap_format == HEATMAP_CSV)
+    {
+        FILE *fp = fopen(filename, "w");
+        if(fp == NULL)
+        {
+            fprintf(stderr, "Unable to open file '%s'\n", filename);
+        }
+        else
+        {
+            for(int r = 0; r < rows; r++)
+            {
+                for(int c = 0; c < columns; c++) fprintf(fp, "%s%.4f", c ? "," : "", density[r * columns + c]);
+                fprintf(fp, "\n");
+            }
+            fclose(fp);
+        }
+    }
+    else
+    {
+        unsigned char *levels = malloc(columns * rows);
+        for(int k = 0; k < columns * rows; k++) levels[k] = (unsigned char)lround(255 * density[k]);
+        write_gray_image(levels, (char *)filename, columns, rows);
+        free(levels);
+    }
+    free(density);
+    free(cell_height);
+    free(cell_width);
+}
+
+/* Return: whether op can be produced from the threshold mask alone. */
+int mask_operator(enum edge_operator op)
+{
+    return op == OP_THRESHOLD || op == OP_THIN || op == OP_DISTANCE;
+}
+
+/* Run everything requested on one image and write the results, named after index.
+ The fused pass reads the rows stride bytes apart where they lie; pipelines, runtime kernels and the tiled layout
+ work on packed rows, so a padded image is packed for them first.
+ For a mask read from an RLE file, img is NULL and mask (which is freed here) replaces the fused pass; only the
+ outputs that start from the mask are written. In motion mode previous is the frame before img, with the same stride,
+ and the fused pass filters their difference.
+ */
+void process_image(PPMPixel *img, const PPMPixel *previous, unsigned long int stride, unsigned long int width, unsigned long int height, unsigned char *mask, int index, const char *label)
+{
+    PPMPixel *packed = img;
+
+    if(img && stride != width * sizeof(PPMPixel) && (pipeline_enabled || kernel_enabled || image_layout == LAYOUT_TILED))
+    {
+        packed = malloc(width * height * sizeof(PPMPixel));
+        for(unsigned long int y = 0; y < height; y++)
+        {
+            memcpy(packed + y * width, image_row(img, stride, y), width * sizeof(PPMPixel));
+        }
+    }
+
+    struct filter_outputs out = { 0 };
+    struct int_list mask_runs = { 0 };
+    float *distance = NULL;
+    int distance_needed = 0;
+    out.mask = mask;
+    out.threshold = threshold_value;
+    out.sharpen_alpha = sharpen_alpha;
+    if(hog_enabled && img)
+    {
+        out.magnitude = malloc(width * height * sizeof(float));
+        out.orientation = malloc(width * height * sizeof(float));
+    }
+    if(corners_enabled && img)
+    {
+        out.tensor = malloc(3 * width * height * sizeof(float));
+    }
+    for(int i = 0; i < output_count; i++)
+    {
+        if(!img && !mask_operator(output_specs[i].op))
+        {
+            fprintf(stderr, "'%s' needs an image, not written for the mask %s\n", operator_names[output_specs[i].op], label);
+            continue;
+        }
+        if(img && output_specs[i].op == OP_THRESHOLD && output_specs[i].format == FORMAT_RLE)
+        {
+            out.mask_runs = &mask_runs;
+        }
+        switch(output_specs[i].op)
+        {
+            case OP_LAPLACIAN:
+                if(!out.laplacian) out.laplacian = (PPMPixel*)malloc(width * height * sizeof(PPMPixel));
+                break;
+            case OP_SOBEL:
+                if(!out.sobel) out.sobel = (PPMPixel*)malloc(width * height * sizeof(PPMPixel));
+                break;
+            case OP_THRESHOLD:
+                if(!out.mask) out.mask = (unsigned char*)malloc(width * height);
+                break;
+            case OP_DIZENZO:
+                if(!out.dizenzo) out.dizenzo = (unsigned char*)malloc(width * height);
+                break;
+            case OP_DISTANCE:
+                //The distance transform starts from the threshold mask.
+                if(!out.mask) out.mask = (unsigned char*)malloc(width * height);
+                distance_needed = 1;
+                break;
+            case OP_SHARPEN:
+                if(!out.sharpen) out.sharpen = (PPMPixel*)malloc(width * height * sizeof(PPMPixel));
+                break;
+            case OP_THIN:
+                if(!out.mask) out.mask = (unsigned char*)malloc(width * height);
+                if(!out.thin) out.thin = (unsigned char*)malloc(width * height);
+                break;
+            default:
+                break;
+        }
+    }
+    int *heat_column = NULL;
+    if(heatmap_enabled && img)
+    {
+        out.heatmap_columns = (unsigned long int)heatmap_columns < width ? heatmap_columns : (int)width;
+        out.heatmap_rows = (unsigned long int)heatmap_rows < height ? heatmap_rows : (int)height;
+        out.heatmap = calloc(out.heatmap_columns * out.heatmap_rows, sizeof(unsigned long int));
+        heat_column = malloc(width * sizeof(int));
+        for(unsigned long int x = 0; x < width; x++) heat_column[x] = x * out.heatmap_columns / width;
+        out.heat_column = heat_column;
+    }
+    if(contours_enabled && !out.mask)
+    {
+        //Contours are traced on the threshold mask.
+        out.mask = (unsigned char*)malloc(width * height);
+    }
+
+    if(img && !previous && image_layout == LAYOUT_TILED && out.laplacian && !out.sobel && !out.mask && !out.dizenzo && !out.sharpen && !hog_enabled && !out.heatmap && !out.tensor)
+    {
+        //The tiled layout only carries the Laplacian; other operators keep using the scanline pass.
+        free(out.laplacian);
+        out.laplacian = apply_filters_tiled(packed, width, height, &total_elapsed_time, NULL);
+    }
+    else if(img && (output_count > 0 || hog_enabled || contours_enabled || heatmap_enabled || corners_enabled))
+    {
+        apply_fused_filters_motion(img, previous, stride, width, height, &out, &total_elapsed_time);
+        if(stats_enabled)
+        {
+            fprintf(stderr, "stats %s: %lu of %lu tiles flat (%.1f%%), skipped\n", label, out.flat_tiles, out.tiles, out.tiles ? 100.0 * out.flat_tiles / out.tiles : 0.0);
+        }
+    }
+
+    if(out.heatmap)
+    {
+        char heatmap_file_name[64];
+        snprintf(heatmap_file_name, sizeof(heatmap_file_name), "heatmap%d.%s", index, heatmap_format_names[heatmap_format]);
+        write_heatmap(&out, width, height, heatmap_file_name);
+    }
+
+    if(out.thin)
+    {
+        int steps;
+        unsigned long int rows_visited;
+        double thin_seconds = 0;
+        memcpy(out.thin, out.mask, width * height);
+        thin_mask(out.thin, width, height, &steps, &rows_visited, &thin_seconds);
+        pthread_mutex_lock(&mutex_c);
+        total_elapsed_time += thin_seconds;
+        pthread_mutex_unlock(&mutex_c);
+        if(stats_enabled)
+        {
+            fprintf(stderr, "stats %s: thinning took %d iterations (%d sub-iterations), visited %lu of %lu rows (%.1f%%), %.4f s\n", label, (steps + 1) / 2, steps,
+                    rows_visited, steps * height, 100.0 * rows_visited / (steps * height), thin_seconds);
+        }
+    }
+
+    if(hog_enabled && img)
+    {
+        char hog_file_name[64];
+        snprintf(hog_file_name, sizeof(hog_file_name), "hog%d.bin", index);
+        write_hog(out.magnitude, out.orientation, width, height, hog_file_name, &total_elapsed_time);
+    }
+
+    if(contours_enabled)
+    {
+        char contour_file_name[64];
+        double contour_seconds = 0;
+        struct contour_set contours = trace_contours(out.mask, width, height, &contour_seconds);
+        snprintf(contour_file_name, sizeof(contour_file_name), "contours%d.%s", index, contour_format_names[contour_format]);
+        unsigned long int bytes = write_contours(&contours, contour_file_name, contour_format, width, height);
+        pthread_mutex_lock(&mutex_c);
+        total_elapsed_time += contour_seconds;
+        pthread_mutex_unlock(&mutex_c);
+        if(stats_enabled)
+        {
+            fprintf(stderr, "stats %s: %lu contours (%lu shorter ones dropped), %lu points, %lu bytes (%.2f%% of the %lu-byte image), traced in %.4f s\n", label,
+                    contours.starts.count, contours.dropped, contours.coords.count / 2, bytes, 100.0 * bytes / (width * height * sizeof(PPMPixel)), width * height * sizeof(PPMPixel), contour_seconds);
+        }
+        free(contours.coords.items);
+        free(contours.starts.items);
+    }
+
+    if(distance_needed)
+    {
+        distance = distance_transform(out.mask, width, height, &total_elapsed_time);
+    }
+
+    if(corners_enabled && img)
+    {
+        char corner_file_name[64];
+        unsigned long int count;
+        struct corner_point *points = detect_corners(out.tensor, width, height, &count, &total_elapsed_time);
+        snprintf(corner_file_name, sizeof(corner_file_name), "corners%d.txt", index);
+        write_corners(points, count, corner_file_name);
+        free(points);
+    }
+
+    if(pipeline_enabled && img)
+    {
+        char pipeline_file_name[64];
+        PPMPixel *result = run_pipeline(&active_pipeline, packed, width, height, &total_elapsed_time, label);
+        snprintf(pipeline_file_name, sizeof(pipeline_file_name), "pipeline%d.ppm", index);
+        write_image(result, pipeline_file_name, width, height);
+        free(result);
+    }
+
+    if(kernel_enabled && img)
+    {
+        char kernel_file_name[64];
+        PPMPixel *result = apply_kernel(&active_kernel, KERNEL_AUTO, packed, width, height, &total_elapsed_time);
+        snprintf(kernel_file_name, sizeof(kernel_file_name), "convolution%d.ppm", index);
+        write_image(result, kernel_file_name, width, height);
+        free(result);
+    }
+
+    for(int i = 0; i < output_count; i++)
+    {
+        char output_file_name[64];
+        if(!img && !mask_operator(output_specs[i].op)) continue;
+        snprintf(output_file_name, sizeof(output_file_name), "%s%d.%s", operator_names[output_specs[i].op], index, format_names[output_specs[i].format]);
+        if(output_specs[i].op == OP_DISTANCE)
+        {
+            write_distance(distance, output_file_name, width, height, output_specs[i].format);
+        }
+        else if(output_specs[i].format == FORMAT_RLE)
+        {
+            //The threshold runs of an image come from the pass; the thinned mask and a decoded mask are encoded here.
+            struct int_list encoded = { 0 };
+            struct int_list *runs = &encoded;
+            if(output_specs[i].op == OP_THRESHOLD && out.mask_runs) runs = out.mask_runs;
+            else run_length_encode(output_specs[i].op == OP_THIN ? out.thin : out.mask, width * height, &encoded);
+            enum rle_coding coding;
+            unsigned long int bytes = write_mask_runs(runs, output_file_name, width, height, &coding);
+            if(stats_enabled)
+            {
+                fprintf(stderr, "stats %s: %s holds %lu runs in %lu bytes (%s), %.1f:1 against the 8-bit mask, %.1f:1 against a bit-packed one\n", label, output_file_name,
+                        runs->count, bytes, rle_coding_names[coding], (double)width * height / bytes, (width * height + 7) / 8.0 / bytes);
+            }
+            free(encoded.items);
+        }
+        else
+        {
+            write_output(&output_specs[i], &out, output_file_name, width, height);
+        }
+    }
+    free(mask_runs.items);
+    free(out.heatmap);
+    free(heat_column);
+    free(distance);
+    free(out.laplacian);
+    free(out.sobel);
+    free(out.mask);
+    free(out.dizenzo);
+    free(out.thin);
+    free(out.sharpen);
+    free(out.magnitude);
+    free(out.orientation);
+    free(out.tensor);
+
+    if(packed != img) free(packed);
+}
+
+/* The thread function that manages an image file. 
+ Read an image file that is passed as an argument at runtime. 
+ Apply every requested operator in a single fused pass (P7 files: the multi-channel Laplacian, PF/Pf: in float). 
+ Save each result in a file called <operator>i.<format>, where i is the image file order in the passed arguments.
+ Example: the laplacian of the file passed third during the input shall be called "laplacian3.ppm".
+*/
+void *manage_image_file(void *args)
+{
+    //Initializing file_name_args
+    struct file_name_args* file_name = (struct file_name_args*) args;
     unsigned long int width;
     unsigned long int height;
 
-    PPMPixel *img = read_image(file_name->input_file_name, &width, &height);
+    //Motion mode pairs P6 frames only.
+    if(file_name->previous_file_name && (image_magic(file_name->previous_file_name) != '6' || image_magic(file_name->input_file_name) != '6'))
+    {
+        fprintf(stderr, "--motion needs P6 frames, '%s' and '%s' are not both\n", file_name->previous_file_name, file_name->input_file_name);
+        return NULL;
+    }
+
+    //P7 files can hold any number of channels and take the multi-channel path, which only has the Laplacian.
+    if(image_magic(file_name->input_file_name) == '7')
+    {
+        const char *label = file_name->input_file_name;
+        for(int i = 0; i < output_count; i++)
+        {
+            if(output_specs[i].op != OP_LAPLACIAN)
+            {
+                fprintf(stderr, "'%s' needs an RGB image, not written for the PAM %s\n", operator_names[output_specs[i].op], label);
+            }
+        }
+        if(contours_enabled) fprintf(stderr, "'contours' needs an RGB image, not written for the PAM %s\n", label);
+        if(hog_enabled) fprintf(stderr, "'hog' needs an RGB image, not written for the PAM %s\n", label);
+        if(heatmap_enabled) fprintf(stderr, "'heatmap' needs an RGB image, not written for the PAM %s\n", label);
+        if(corners_enabled) fprintf(stderr, "'corners' needs an RGB image, not written for the PAM %s\n", label);
+        if(pipeline_enabled) fprintf(stderr, "'pipeline' needs an RGB image, not written for the PAM %s\n", label);
+        if(kernel_enabled) fprintf(stderr, "'kernel' needs an RGB image, not written for the PAM %s\n", label);
+        process_pam_file(file_name->input_file_name, file_name->index);
+        return NULL;
+    }
+    //PF and Pf files are filtered in float.
+    if(image_magic(file_name->input_file_name) == 'F' || image_magic(file_name->input_file_name) == 'f')
+    {
+        process_pfm_file(file_name->input_file_name, file_name->index);
+        return NULL;
+    }
+    //RLE files hold a threshold mask, which takes the place of the fused pass.
+    if(mask_runs_file(file_name->input_file_name))
+    {
+        unsigned char *mask = read_mask_runs(file_name->input_file_name, &width, &height);
+        if(mask) process_image(NULL, NULL, 0, width, height, mask, file_name->index, file_name->input_file_name);
+        return NULL;
+    }
 
-    PPMPixel *result = apply_filters(img, width, height, &total_elapsed_time);
+    PPMPixel *img = read_image(file_name->input_file_name, &width, &height);
+    PPMPixel *previous = NULL;
 
-    if(result)
+    //In motion mode the outputs come from the difference with the frame before.
+    if(file_name->previous_file_name)
     {
-        write_image(result, file_name->output_file_name, width, height);
+        unsigned long int previous_width, previous_height;
+        previous = read_image(file_name->previous_file_name, &previous_width, &previous_height);
+        if(previous_width != width || previous_height != height)
+        {
+            fprintf(stderr, "Frames '%s' and '%s' differ in size\n", file_name->previous_file_name, file_name->input_file_name);
+            free(previous);
+            free(img);
+            return NULL;
+        }
     }
-    free(result);
 
+    process_image(img, previous, width * sizeof(PPMPixel), width, height, NULL, file_name->index, file_name->input_file_name);
+
+    free(previous);
     free(img);
     return NULL;
 }
-/*The driver of the program. Check for the correct number of arguments. If wrong print the message: "Usage ./a.out filename[s]"
+
+/* Headerless raw input.
+ With --raw=WxHxC[:DEPTH[:STRIDE]], or --raw=@FILE naming a JSON sidecar with "width", "height", "channels", "depth"
+ and "stride" keys, every input is one frame of raw interleaved samples whose rows are STRIDE bytes apart (default
+ W*C). The file is mapped and filtered in place: three channel frames go through the fused pass with their stride,
+ single channel frames through the gray Laplacian (laplaciani.pgm). Only 8-bit samples are filtered in place.
+ */
+struct raw_geometry {
+    int enabled;
+    unsigned long int w;
+    unsigned long int h;
+    int channels;
+    int depth;               //bits per sample
+    unsigned long int stride;    //bytes from one row to the next, 0 for packed rows
+};
+
+struct raw_geometry raw_input = { 0, 0, 0, 0, 8, 0 };
+
+/* Return: the number after "key": in the JSON text, or fallback when the key is missing. */
+long int json_number(const char *text, const char *key, long int fallback)
+{
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *at = strstr(text, quoted);
+    if(!at) return fallback;
+    at = strchr(at + strlen(quoted), ':');
+    return at ? strtol(at + 1, NULL, 10) : fallback;
+}
+
+/* Parse "640x480x3:8:1936" or "@frame.json" into g.
+ Return: 0 on success, -1 with a message on stderr otherwise.
+ */
+int parse_raw_geometry(const char *arg, struct raw_geometry *g)
+{
+    g->depth = 8;
+    g->stride = 0;
+    if(arg[0] == '@')
+    {
+        FILE *fp = fopen(arg + 1, "rb");
+        char text[4096];
+        if(!fp)
+        {
+            fprintf(stderr, "Unable to open file '%s'\n", arg + 1);
+            return -1;
+        }
+        size_t got = fread(text, 1, sizeof(text) - 1, fp);
+        text[got] = '\0';
+        fclose(fp);
+        g->w = json_number(text, "width", 0);
+        g->h = json_number(text, "height", 0);
+        g->channels = json_number(text, "channels", 3);
+        g->depth = json_number(text, "depth", json_number(text, "bit_depth", 8));
+        g->stride = json_number(text, "stride", 0);
+    }
+    else if(sscanf(arg, "%lux%lux%d:%d:%lu", &g->w, &g->h, &g->channels, &g->depth, &g->stride) < 3)
+    {
+        fprintf(stderr, "Invalid raw geometry '%s', expected WxHxC[:DEPTH[:STRIDE]]\n", arg);
+        return -1;
+    }
+
+    if(g->w == 0 || g->h == 0 || (g->channels != 1 && g->channels != 3))
+    {
+        fprintf(stderr, "Raw input needs a size and 1 or 3 channels\n");
+        return -1;
+    }
+    if(g->depth != 8)
+    {
+        fprintf(stderr, "Raw input of depth %d is not supported, only 8-bit samples are filtered in place\n", g->depth);
+        return -1;
+    }
+    if(g->stride == 0) g->stride = g->w * g->channels;
+    if(g->stride < g->w * g->channels)
+    {
+        fprintf(stderr, "Raw stride %lu is shorter than a row of %lu bytes\n", g->stride, g->w * g->channels);
+        return -1;
+    }
+    g->enabled = 1;
+    return 0;
+}
+
+/* The thread function that manages a raw file: maps it and filters the frame without copying or unpadding it. */
+void *manage_raw_file(void *args)
+{
+    struct file_name_args* file_name = (struct file_name_args*) args;
+    const struct raw_geometry *g = &raw_input;
+    unsigned long int frame_size = g->stride * (g->h - 1) + g->w * g->channels;
+    unsigned long int mapped_size;
+
+    unsigned char *data = map_input_file(file_name->input_file_name, frame_size, &mapped_size);
+    if(!data)
+    {
+        return NULL;
+    }
+
+    if(g->channels == 3)
+    {
+        process_image((PPMPixel *)data, NULL, g->stride, g->w, g->h, NULL, file_name->index, file_name->input_file_name);
+    }
+    else
+    {
+        char output_file_name[64];
+        unsigned char *result = apply_filters_gray(data, g->stride, 1, g->w, g->h, &total_elapsed_time);
+        snprintf(output_file_name, sizeof(output_file_name), "laplacian%d.pgm", file_name->index);
+        write_gray_image(result, output_file_name, g->w, g->h);
+        free(result);
+    }
+
+    unmap_input_file(file_name->input_file_name, data, mapped_size);
+    return NULL;
+}
+
+/* Parse an -o argument of the form operator[:format] into spec, e.g. "sobel:pgm". The format defaults to ppm, or to pfm
+ for distances, which cannot be written as ppm; pfm is for distances only.
+ Return: 0 on success, -1 if the operator or format is unknown or they do not go together.
+ */
+int parse_output_spec(const char *arg, struct output_spec *spec)
+{
+    const char *colon = strchr(arg, ':');
+    size_t name_length = colon ? (size_t)(colon - arg) : strlen(arg);
+    int op, format = FORMAT_PPM;
+
+    for(op = 0; op < OP_COUNT; op++)
+    {
+        if(strlen(operator_names[op]) == name_length && strncmp(arg, operator_names[op], name_length) == 0) break;
+    }
+    if(op == OP_COUNT) return -1;
+
+    if(colon)
+    {
+        for(format = 0; format < FORMAT_COUNT; format++)
+        {
+            if(strcmp(colon + 1, format_names[format]) == 0) break;
+        }
+        if(format == FORMAT_COUNT) return -1;
+    }
+    else if(op == OP_DISTANCE)
+    {
+        format = FORMAT_PFM;
+    }
+    if(format == FORMAT_PFM ? op != OP_DISTANCE : (op == OP_DISTANCE && format == FORMAT_PPM)) return -1;
+    if(format == FORMAT_RLE && op != OP_THRESHOLD && op != OP_THIN) return -1;
+    spec->op = op;
+    spec->format = format;
+    return 0;
+}
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] filename[s]\n", program);
+    fprintf(stderr, "  -o, --output=OP[:FORMAT]  write OP (laplacian, sobel, threshold, dizenzo, distance, thin, sharpen) as FORMAT (ppm, pgm, pfm, rle); repeatable, all outputs come from one pass\n");
+    fprintf(stderr, "  -t, --threshold=N         laplacian strength at which the threshold mask turns on (default %d)\n", DEFAULT_THRESHOLD);
+    fprintf(stderr, "      --sharpen=ALPHA       strength of -o sharpen, original + ALPHA * laplacian (default 1.0, steps of 1/256)\n");
+    fprintf(stderr, "      --no-flat-skip        filter uniform tiles pixel by pixel instead of skipping them\n");
+    fprintf(stderr, "      --layout=LAYOUT       scanline (default) or tiled: padded %dx%d tiles in Morton order for the Laplacian\n", LAYOUT_TILE, LAYOUT_TILE);
+    fprintf(stderr, "      --stats               print per-image statistics of the passes to stderr\n");
+    fprintf(stderr, "      --motion              inputs are consecutive frames; output i is computed from |frame i+1 - frame i|\n");
+    fprintf(stderr, "      --stream              inputs (\"-\" is stdin) hold back to back P6 frames; frame k is written as laplaciani_k.ppm\n");
+    fprintf(stderr, "      --realtime[=N]        for --stream and --yuv: read frames in a thread, keep the N newest unfiltered ones (default %d),\n", DEFAULT_REALTIME_DEPTH);
+    fprintf(stderr, "                            drop older ones, and report the latency percentiles\n");
+    fprintf(stderr, "      --shm-in=NAME         filter the frames of the shared memory ring NAME in place instead of files\n");
+    fprintf(stderr, "      --shm-out=NAME        with --shm-in: write the Laplacian into a new ring NAME instead of laplacian1_k.ppm\n");
+    fprintf(stderr, "      --yuv=FMT:WxH[:STRIDE] inputs are raw nv12, i420 or yuyv frames (\"-\" reads stdin); writes the luma Laplacian as laplaciani[_k].pgm\n");
+    fprintf(stderr, "      --bayer=PAT:WxH[:BITS] inputs are raw rggb, grbg, gbrg or bggr mosaics (16-bit containers above 8 bits)\n");
+    fprintf(stderr, "      --bayer-mode=MODE     luma (half resolution, default) or cfa (same-colour full resolution Laplacian)\n");
+    fprintf(stderr, "      --raw=WxHxC[:DEPTH[:STRIDE]] inputs are headerless 8-bit frames with 1 or 3 channels and rows STRIDE bytes apart;\n");
+    fprintf(stderr, "                            @FILE reads the geometry from a JSON sidecar\n");
+    fprintf(stderr, "      --channels=LIST       channels of P7 inputs to read and filter, e.g. 0,3,5-7 (default all)\n");
+    fprintf(stderr, "      --half                hold PF/Pf images as half floats while filtering\n");
+    fprintf(stderr, "      --float-isa=ISA       row kernel for PF/Pf images: scalar, avx2, avx512 (default: best supported)\n");
+    fprintf(stderr, "      --corners[=METHOD]    write the strongest corners as cornersi.txt; METHOD is harris (default) or shi-tomasi\n");
+    fprintf(stderr, "      --corner-window=[box:|gauss:]R  window of radius R (1 to %d) the gradient products are summed over (default gauss:2)\n", MAX_CORNER_RADIUS);
+    fprintf(stderr, "      --corner-count=K      number of corners kept (default %d)\n", DEFAULT_CORNER_COUNT);
+    fprintf(stderr, "      --hog                 write HOG descriptors built from the fused pass gradient as hogi.bin\n");
+    fprintf(stderr, "      --hog-cell=N          HOG cell size in pixels (default %d)\n", DEFAULT_HOG_CELL);
+    fprintf(stderr, "      --heatmap[=CxR]       write the edge pixel density over a grid of C x R cells (default 32x32) as heatmapi.pgm\n");
+    fprintf(stderr, "      --heatmap-format=FMT  pgm (default) or csv\n");
+    fprintf(stderr, "      --contours[=FORMAT]   write the outlines of the threshold mask as contoursi.bin (default) or contoursi.json\n");
+    fprintf(stderr, "      --contour-epsilon=E   Douglas-Peucker tolerance in pixels for the contours (default %g, 0 is exact)\n", DEFAULT_CONTOUR_EPSILON);
+    fprintf(stderr, "      --contour-min-length=L  leave out contours with a perimeter under L pixels (default %g)\n", DEFAULT_CONTOUR_MIN_LENGTH);
+    fprintf(stderr, "  -p, --pipeline=STAGES     run a stage chain such as \"blur,laplacian,threshold:40,dilate\" and write pipelinei.ppm;\n");
+    fprintf(stderr, "                            @FILE reads the chain from a config file\n");
+    fprintf(stderr, "      --schedule            print the fused pipeline schedule and per-stage timing\n");
+    fprintf(stderr, "  -k, --kernel=WxH[/D]:C,.. convolve with a runtime kernel and write convolutioni.ppm; @FILE reads it from a file\n");
+    fprintf(stderr, "      --no-jit              always use the generic loop for runtime kernels\n");
+    fprintf(stderr, "      --fft-crossover=N     runtime kernels at least N wide or tall use FFT convolution (default %d, 0 disables)\n", DEFAULT_FFT_CROSSOVER);
+    fprintf(stderr, "      --bench               compare the static Laplacian with the runtime kernel paths and exit\n");
+}
+
+/*The driver of the program. Check for the correct number of arguments. If wrong print the usage message.
   It shall accept n filenames as arguments, separated by whitespace, e.g., ./a.out file1.ppm file2.ppm    file3.ppm
+  Options before the filenames select which outputs the fused pass writes; without any, only laplaciani.ppm is written.
   It will create a thread for each input file to manage.  
   It will print the total elapsed time in .4 precision seconds(e.g., 0.1234 s). 
   The total elapsed time is the total time taken by all threads to compute the edge detection of all input images .
  */
 int main(int argc, char *argv[])
 {
-    if(argc <= 1)
+    static struct option long_options[] = {
+        { "output",    required_argument, 0, 'o' },
+        { "threshold", required_argument, 0, 't' },
+        { "no-flat-skip", no_argument,    0, 'Z' },
+        { "stats",     no_argument,       0, 's' },
+        { "layout",    required_argument, 0, 'L' },
+        { "yuv",       required_argument, 0, 'Y' },
+        { "bayer",     required_argument, 0, 'R' },
+        { "bayer-mode", required_argument, 0, 'M' },
+        { "raw",       required_argument, 0, 'W' },
+        { "channels",  required_argument, 0, 'C' },
+        { "half",      no_argument,       0, 'H' },
+        { "corners",   optional_argument, 0, 'c' },
+        { "corner-window", required_argument, 0, 'w' },
+        { "corner-count",  required_argument, 0, 'n' },
+        { "hog",       no_argument,       0, 'G' },
+        { "sharpen",   required_argument, 0, 'a' },
+        { "hog-cell",  required_argument, 0, 'g' },
+        { "contours",  optional_argument, 0, 'T' },
+        { "contour-epsilon", required_argument, 0, 'E' },
+        { "contour-min-length", required_argument, 0, 'N' },
+        { "heatmap",   optional_argument, 0, 'D' },
+        { "motion",    no_argument,       0, 'm' },
+        { "stream",    no_argument,       0, 'K' },
+        { "realtime",  optional_argument, 0, 'Q' },
+        { "shm-in",    required_argument, 0, 'X' },
+        { "shm-out",   required_argument, 0, 'O' },
+        { "heatmap-format", required_argument, 0, 'V' },
+        { "float-isa", required_argument, 0, 'I' },
+        { "pipeline",  required_argument, 0, 'p' },
+        { "schedule",  no_argument,       0, 'S' },
+        { "kernel",    required_argument, 0, 'k' },
+        { "no-jit",    no_argument,       0, 'J' },
+        { "fft-crossover", required_argument, 0, 'F' },
+        { "bench",     no_argument,       0, 'B' },
+        { "help",      no_argument,       0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    int option, explicit_outputs = 0, bench = 0;
+
+    while((option = getopt_long(argc, argv, "o:t:p:k:h", long_options, NULL)) != -1)
+    {
+        switch(option)
+        {
+            case 'o':
+                if(explicit_outputs == MAX_OUTPUTS)
+                {
+                    fprintf(stderr, "At most %d outputs can be requested\n", MAX_OUTPUTS);
+                    return 1;
+                }
+                if(parse_output_spec(optarg, &output_specs[explicit_outputs]) != 0)
+                {
+                    fprintf(stderr, "Invalid output '%s'\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                output_count = ++explicit_outputs;
+                break;
+            case 't':
+                threshold_value = atoi(optarg);
+                break;
+            case 'Z':
+                flat_skip_enabled = 0;
+                break;
+            case 's':
+                stats_enabled = 1;
+                break;
+            case 'L':
+                if(strcmp(optarg, "tiled") == 0) image_layout = LAYOUT_TILED;
+                else if(strcmp(optarg, "scanline") == 0) image_layout = LAYOUT_SCANLINE;
+                else
+                {
+                    fprintf(stderr, "Unknown layout '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Y':
+                if(parse_yuv_geometry(optarg, &yuv_input) != 0)
+                {
+                    fprintf(stderr, "Invalid raw frame geometry '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                if(parse_bayer_geometry(optarg, &bayer_input) != 0)
+                {
+                    fprintf(stderr, "Invalid Bayer geometry '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'M':
+                if(strcmp(optarg, "luma") == 0) bayer_input.mode = BAYER_LUMA;
+                else if(strcmp(optarg, "cfa") == 0) bayer_input.mode = BAYER_CFA;
+                else
+                {
+                    fprintf(stderr, "Unknown Bayer mode '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'W':
+                if(parse_raw_geometry(optarg, &raw_input) != 0)
+                {
+                    return 1;
+                }
+                break;
+            case 'C':
+                if(parse_channel_list(optarg) != 0)
+                {
+                    fprintf(stderr, "Invalid channel list '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                half_storage = 1;
+                break;
+            case 'G':
+                hog_enabled = 1;
+                break;
+            case 'a':
+            {
+                double alpha = atof(optarg);
+                if(alpha < -16 || alpha > 16)
+                {
+                    fprintf(stderr, "Sharpening strength '%s' must lie between -16 and 16\n", optarg);
+                    return 1;
+                }
+                sharpen_alpha = (int)lround(alpha * (1 << SHARPEN_SHIFT));
+                break;
+            }
+            case 'g':
+                hog_cell = atoi(optarg);
+                if(hog_cell < 1)
+                {
+                    fprintf(stderr, "Invalid HOG cell size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                motion_enabled = 1;
+                break;
+            case 'K':
+                stream_enabled = 1;
+                break;
+            case 'Q':
+                realtime_depth = optarg ? atoi(optarg) : DEFAULT_REALTIME_DEPTH;
+                if(realtime_depth < 1)
+                {
+                    fprintf(stderr, "Invalid realtime depth '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'X':
+                shm_input_name = optarg;
+                break;
+            case 'O':
+                shm_output_name = optarg;
+                break;
+            case 'D':
+                heatmap_enabled = 1;
+                if(optarg && (sscanf(optarg, "%dx%d", &heatmap_columns, &heatmap_rows) != 2 || heatmap_columns < 1 || heatmap_rows < 1))
+                {
+                    fprintf(stderr, "Invalid heatmap grid '%s', expected CxR\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'V':
+            {
+                int format;
+                for(format = 0; format < HEATMAP_FORMAT_COUNT && strcmp(optarg, heatmap_format_names[format]) != 0; format++);
+                if(format == HEATMAP_FORMAT_COUNT)
+                {
+                    fprintf(stderr, "Unknown heatmap format '%s'\n", optarg);
+                    return 1;
+                }
+                heatmap_format = format;
+                break;
+            }
+            case 'T':
+                contours_enabled = 1;
+                if(optarg)
+                {
+                    int format;
+                    for(format = 0; format < CONTOUR_FORMAT_COUNT && strcmp(optarg, contour_format_names[format]) != 0; format++);
+                    if(format == CONTOUR_FORMAT_COUNT)
+                    {
+                        fprintf(stderr, "Unknown contour format '%s'\n", optarg);
+                        return 1;
+                    }
+                    contour_format = format;
+                }
+                break;
+            case 'E':
+                contour_epsilon = atof(optarg);
+                if(contour_epsilon < 0)
+                {
+                    fprintf(stderr, "Invalid contour epsilon '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                contour_min_length = atof(optarg);
+                if(contour_min_length < 0)
+                {
+                    fprintf(stderr, "Invalid contour minimum length '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                corners_enabled = 1;
+                if(optarg)
+                {
+                    int method;
+                    for(method = 0; method < CORNER_METHOD_COUNT && strcmp(optarg, corner_method_names[method]) != 0; method++);
+                    if(method == CORNER_METHOD_COUNT)
+                    {
+                        fprintf(stderr, "Unknown corner method '%s'\n", optarg);
+                        return 1;
+                    }
+                    corner_method = method;
+                }
+                break;
+            case 'w':
+                if(parse_corner_window(optarg) != 0)
+                {
+                    fprintf(stderr, "Invalid corner window '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                corner_count = strtoul(optarg, NULL, 10);
+                if(corner_count == 0)
+                {
+                    fprintf(stderr, "Invalid corner count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'I':
+                for(float_isa = 0; float_isa < ISA_COUNT && strcmp(optarg, float_isa_names[float_isa]) != 0; float_isa++);
+                if(float_isa == ISA_COUNT || float_isa > best_float_isa())
+                {
+                    fprintf(stderr, "Row kernel '%s' is unknown or not supported by this CPU\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if(load_pipeline(optarg, &active_pipeline) != 0)
+                {
+                    return 1;
+                }
+                pipeline_enabled = 1;
+                break;
+            case 'S':
+                pipeline_schedule = 1;
+                break;
+            case 'k':
+                if(load_kernel(optarg, &active_kernel) != 0)
+                {
+                    return 1;
+                }
+                kernel_enabled = 1;
+                break;
+            case 'J':
+                jit_enabled = 0;
+                break;
+            case 'F':
+                fft_crossover = atoi(optarg);
+                break;
+            case 'B':
+                bench = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if(float_isa < 0)
+    {
+        float_isa = best_float_isa();
+    }
+
+    if(bench)
+    {
+        return run_benchmarks();
+    }
+
+    //A pipeline, a runtime kernel or a heatmap replaces the default laplacian output unless outputs were asked for explicitly.
+    if((pipeline_enabled || kernel_enabled || heatmap_enabled) && explicit_outputs == 0)
+    {
+        output_count = 0;
+    }
+
+    //Streams, realtime sources and shared memory rings are filtered frame by frame with the Laplacian only.
+    int extra_outputs = explicit_outputs > 0 || contours_enabled || hog_enabled || heatmap_enabled || corners_enabled || pipeline_enabled || kernel_enabled;
+    if(extra_outputs && (stream_enabled || realtime_depth > 0 || shm_input_name))
+    {
+        fprintf(stderr, "--stream, --realtime and --shm-in only write the Laplacian and cannot be combined with -o, --contours, --hog, --heatmap, --corners, -p or -k\n");
+        return 1;
+    }
+
+    //Shared memory rings carry their own frames and geometry.
+    if(shm_output_name && !shm_input_name)
+    {
+        fprintf(stderr, "--shm-out needs --shm-in\n");
+        return 1;
+    }
+    if(shm_input_name)
+    {
+        if(optind < argc || stream_enabled || realtime_depth > 0 || motion_enabled || yuv_input.format != YUV_NONE || bayer_input.enabled || raw_input.enabled)
+        {
+            fprintf(stderr, "--shm-in takes no input files and cannot be combined with --stream, --realtime, --motion, --yuv, --bayer or --raw\n");
+            return 1;
+        }
+        int status = run_shm_ring();
+        printf("Time: %.4f\n", total_elapsed_time);
+        return status;
+    }
+
+    if(optind >= argc)
     {
-        fprintf(stderr, "Usage: %s filename[s]\n", argv[0]);
+        print_usage(argv[0]);
         return 0;
     }
 
-    argc--;
-    argv++;
+    //--realtime applies to streams.
+    if(stream_enabled && (yuv_input.format != YUV_NONE || bayer_input.enabled || raw_input.enabled || motion_enabled))
+    {
+        fprintf(stderr, "--stream reads P6 frames and cannot be combined with --yuv, --bayer, --raw or --motion\n");
+        return 1;
+    }
+    if(realtime_depth > 0 && ((!stream_enabled && yuv_input.format == YUV_NONE) || motion_enabled))
+    {
+        fprintf(stderr, "--realtime applies to --stream and --yuv inputs, without --motion\n");
+        return 1;
+    }
+
+    //Pipelines and runtime kernels read the frame itself, so motion mode leaves them out.
+    if(motion_enabled && (pipeline_enabled || kernel_enabled || bayer_input.enabled || raw_input.enabled))
+    {
+        fprintf(stderr, "--motion only applies to the fused outputs (and the stages built on them) of P6 and --yuv inputs, not to -p, -k, --bayer or --raw\n");
+        return 1;
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    //P6 frames in motion mode: output i comes from inputs i and i+1.
+    int motion_pairs = motion_enabled && yuv_input.format == YUV_NONE;
+    if(motion_pairs)
+    {
+        if(argc < 2)
+        {
+            fprintf(stderr, "--motion needs at least two frames\n");
+            return 1;
+        }
+        argc--;
+    }
 
     pthread_t t[argc];
     struct file_name_args *file_name = calloc(argc, sizeof(struct file_name_args));
     for(int i = 0; i < argc; i++) 
     {
-        file_name[i].input_file_name = argv[i];
+        file_name[i].input_file_name = motion_pairs ? argv[i + 1] : argv[i];
+        file_name[i].previous_file_name = motion_pairs ? argv[i] : NULL;
 
-        //If there is result then it will write a file called laplaciani.ppm where i is the image file order in the passed arguments.
+        //The outputs of the image are named after i, the image file order in the passed arguments.
         pthread_mutex_trylock(&mutex_b);
-        snprintf(file_name[i].output_file_name, 20, "laplacian%d.ppm", i +1);
+        file_name[i].index = i + 1;
         pthread_mutex_unlock(&mutex_b);
 
-        if(pthread_create(&t[i], NULL, manage_image_file, (void*)&file_name[i]) != 0)
+        void *(*manage)(void *) = manage_image_file;
+        if(yuv_input.format != YUV_NONE) manage = manage_yuv_file;
+        else if(stream_enabled) manage = manage_stream_file;
+        else if(bayer_input.enabled) manage = manage_bayer_file;
+        else if(raw_input.enabled) manage = manage_raw_file;
+        if(pthread_create(&t[i], NULL, manage, (void*)&file_name[i]) != 0)
         {
             fprintf(stderr, "Unable to create thread %d!\n", i);
         }
@@ -329,4 +6926,3 @@ int main(int argc, char *argv[])
     printf("Time: %.4f\n", total_elapsed_time);
     return 0;
 }
-
@@ -0,0 +1,232 @@
+/*
+A sample producer and consumer for the shared memory rings of the edge detector (shm_ring.h), to measure the
+throughput and latency of filtering frames that never touch a file or a pipe:
+
+    ./shm_bench produce /edin 1920x1080 600 &
+    ./edge_detector --shm-in=/edin --shm-out=/edout &
+    ./shm_bench consume /edout
+
+The producer creates the input ring and writes FRAMES frames into it, either a synthetic pattern of the given size that
+moves from frame to frame or the pixels of a P6 image, as fast as slots free up or at RATE frames per second. The
+consumer reads the results out of the output ring and prints the frames per second and the percentiles of the latency
+from a frame entering the first ring to its result being available.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "shm_ring.h"
+
+#define DEFAULT_SLOTS 4
+
+/* Read the next header number of a P6 image, skipping whitespace and comments.
+ Return: 0 on success, -1 otherwise.
+ */
+int read_header_number(FILE *fp, unsigned long int *value)
+{
+    int c;
+    while((c = fgetc(fp)) != EOF)
+    {
+        if(c == '#')
+        {
+            while((c = fgetc(fp)) != EOF && c != '\n');
+        }
+        else if(!isspace(c))
+        {
+            break;
+        }
+    }
+    if(c == EOF || !isdigit(c)) return -1;
+    *value = 0;
+    while(c != EOF && isdigit(c))
+    {
+        *value = *value * 10 + (c - '0');
+        c = fgetc(fp);
+    }
+    return 0;
+}
+
+/* Read a P6 image with a maximum value of 255.
+ Return: its RGB pixels, or NULL if it cannot be read
+ */
+unsigned char *read_image(const char *filename, unsigned long int *width, unsigned long int *height)
+{
+    FILE *fp = fopen(filename, "rb");
+    unsigned long int maximum = 0;
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        return NULL;
+    }
+    if(fgetc(fp) != 'P' || fgetc(fp) != '6' || read_header_number(fp, width) != 0 || read_header_number(fp, height) != 0
+       || read_header_number(fp, &maximum) != 0 || maximum != 255)
+    {
+        fprintf(stderr, "'%s' is not an 8-bit P6 image\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    unsigned char *pixels = malloc(*width * *height * 3);
+    if(fread(pixels, 3, *width * *height, fp) != *width * *height)
+    {
+        fprintf(stderr, "'%s' is truncated\n", filename);
+        free(pixels);
+        pixels = NULL;
+    }
+    fclose(fp);
+    return pixels;
+}
+
+/* Fill a frame with diagonal colour bands and a square that moves one pixel per frame, so every frame has edges. */
+void synthetic_frame(unsigned char *frame, unsigned long int w, unsigned long int h, uint64_t sequence)
+{
+    unsigned long int side = (w < h ? w : h) / 4;
+    unsigned long int left = side ? sequence % (w - side + 1) : 0, top = h / 2 - side / 2;
+    for(unsigned long int y = 0; y < h; y++)
+    {
+        unsigned char *row = frame + y * w * 3;
+        for(unsigned long int x = 0; x < w; x++)
+        {
+            int inside = x >= left && x < left + side && y >= top && y < top + side;
+            row[3 * x] = inside ? 255 : (unsigned char)(((x + y) / 32) * 40);
+            row[3 * x + 1] = inside ? 255 : (unsigned char)((x / 64) * 50);
+            row[3 * x + 2] = inside ? 0 : (unsigned char)((y / 64) * 30);
+        }
+    }
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Write frames into a new ring until count frames have been published and consumed.
+ Return: 0 on success, 1 otherwise.
+ */
+int produce(const char *name, const char *source, unsigned long int count, uint32_t slots, double rate)
+{
+    unsigned long int w = 0, h = 0;
+    unsigned char *image = NULL;
+    if(sscanf(source, "%lux%lu", &w, &h) != 2 || w == 0 || h == 0)
+    {
+        image = read_image(source, &w, &h);
+        if(!image) return 1;
+    }
+
+    struct shm_ring ring;
+    if(shm_ring_create(&ring, name, slots, w, h) != 0)
+    {
+        free(image);
+        return 1;
+    }
+
+    uint64_t period = rate > 0 ? (uint64_t)(1000000000.0 / rate) : 0;
+    uint64_t started = shm_ring_now();
+    for(unsigned long int i = 0; i < count; i++)
+    {
+        //Paced sources publish frame i at started + i periods, like a camera would.
+        if(period)
+        {
+            uint64_t due = started + i * period, now = shm_ring_now();
+            if(due > now)
+            {
+                struct timespec pause = { (time_t)((due - now) / 1000000000u), (long)((due - now) % 1000000000u) };
+                nanosleep(&pause, NULL);
+            }
+        }
+        struct shm_ring_slot *slot = shm_ring_acquire(&ring);
+        if(image) memcpy(shm_ring_pixels(slot), image, ring.header->frame_size);
+        else synthetic_frame(shm_ring_pixels(slot), w, h, i);
+        slot->sequence = i + 1;
+        slot->timestamp = shm_ring_now();
+        shm_ring_publish(&ring);
+    }
+    double seconds = (double)(shm_ring_now() - started) / 1000000000.0;
+    shm_ring_close(&ring);
+
+    //Unlinking only removes the name, but a consumer that has not attached yet would never find the ring.
+    shm_ring_drain(&ring, 60000);
+    fprintf(stderr, "produced %lu frames of %lux%lu in %.3f s, %.1f frames/s\n", count, w, h, seconds, seconds > 0 ? count / seconds : 0.0);
+    shm_ring_detach(&ring);
+    free(image);
+    return 0;
+}
+
+/* Read every frame of a ring until its producer closes it and report the throughput and latency.
+ Return: 0 on success, 1 otherwise.
+ */
+int consume(const char *name)
+{
+    struct shm_ring ring;
+    if(shm_ring_attach(&ring, name, 60000) != 0)
+    {
+        return 1;
+    }
+
+    unsigned long int received = 0, missing = 0, capacity = 256;
+    double *latencies = malloc(capacity * sizeof(double));
+    uint64_t started = 0, expected = 1, checksum = 0;
+    struct shm_ring_slot *slot;
+    while((slot = shm_ring_next(&ring)) != NULL)
+    {
+        uint64_t now = shm_ring_now();
+        if(received == 0)
+        {
+            started = now;
+            expected = slot->sequence;
+        }
+        if(slot->sequence > expected) missing += slot->sequence - expected;
+        expected = slot->sequence + 1;
+
+        //Touch the result like a real consumer would: one byte per cache line.
+        const unsigned char *pixels = shm_ring_pixels(slot);
+        for(uint64_t i = 0; i < ring.header->frame_size; i += SHM_RING_ALIGN) checksum += pixels[i];
+
+        if(received == capacity)
+        {
+            capacity *= 2;
+            latencies = realloc(latencies, capacity * sizeof(double));
+        }
+        latencies[received++] = (double)(now - slot->timestamp) / 1000000.0;
+        shm_ring_release(&ring);
+    }
+    double seconds = received > 1 ? (double)(shm_ring_now() - started) / 1000000000.0 : 0.0;
+
+    fprintf(stderr, "consumed %lu frames of %ux%u (%lu missing) in %.3f s, %.1f frames/s", received, ring.header->width,
+            ring.header->height, missing, seconds, seconds > 0 ? received / seconds : 0.0);
+    if(received > 0)
+    {
+        qsort(latencies, received, sizeof(double), compare_doubles);
+        fprintf(stderr, "; latency ms p50 %.2f, p90 %.2f, p99 %.2f, max %.2f", latencies[(received - 1) / 2],
+                latencies[(received - 1) * 9 / 10], latencies[(received - 1) * 99 / 100], latencies[received - 1]);
+    }
+    fprintf(stderr, "; checksum %llu\n", (unsigned long long)checksum);
+
+    free(latencies);
+    shm_ring_detach(&ring);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc >= 5 && strcmp(argv[1], "produce") == 0)
+    {
+        int slots = argc > 5 ? atoi(argv[5]) : DEFAULT_SLOTS;
+        double rate = argc > 6 ? atof(argv[6]) : 0.0;
+        if(slots < 1 || atol(argv[4]) < 1)
+        {
+            fprintf(stderr, "Invalid frame or slot count\n");
+            return 1;
+        }
+        return produce(argv[2], argv[3], (unsigned long int)atol(argv[4]), (uint32_t)slots, rate);
+    }
+    if(argc == 3 && strcmp(argv[1], "consume") == 0)
+    {
+        return consume(argv[2]);
+    }
+    fprintf(stderr, "Usage: %s produce NAME WxH|image.ppm FRAMES [SLOTS [RATE]]\n", argv[0]);
+    fprintf(stderr, "       %s consume NAME\n", argv[0]);
+    fprintf(stderr, "  NAME is a POSIX shared memory name such as /edges; SLOTS, a power of two, defaults to %d; RATE is in frames/s, 0 (default) is unpaced\n", DEFAULT_SLOTS);
+    return 1;
+}
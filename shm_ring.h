@@ -0,0 +1,278 @@
+/* A ring of image frames in POSIX shared memory, for one producer process and one consumer process.
+ The producer creates the ring with shm_ring_create, fixing the frame size and the number of slots, and the consumer
+ maps the same object with shm_ring_attach. Frames are written and read in place: the producer gets the next free slot
+ with shm_ring_acquire, fills its pixels and hands it over with shm_ring_publish; the consumer gets the oldest
+ published slot with shm_ring_next and gives it back with shm_ring_release once it is done with the pixels.
+ Each side keeps one counter in the header, frames published and frames released, and waits on the other side's
+ counter with a futex (Linux; elsewhere it sleeps and polls), so no frame is ever copied and no lock is shared.
+ Every slot carries the frame number and the CLOCK_MONOTONIC time the frame entered the first ring, so latency can be
+ measured across any number of rings and processes.
+ The functions are defined here; include this header in one translation unit per program.
+ */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_RING_MAGIC 0x31524445u   //"EDR1"
+#define SHM_RING_ALIGN 64            //slots and the two counters each start on their own cache line
+#define SHM_RING_WAIT_NS 100000000L  //waits wake up at least this often to notice a closed ring
+
+/* The start of the shared object. The counters wrap around at 2^32: their differences stay right, and since the slot
+ count is a power of two, so does the slot a frame number maps to.
+ */
+struct shm_ring_header {
+    uint32_t magic;                  //stored last by shm_ring_create, once the rest is set
+    uint32_t slot_count;
+    uint32_t width;
+    uint32_t height;
+    uint64_t frame_size;             //bytes of pixels per frame, width * height * 3
+    uint64_t slot_size;              //bytes from one slot to the next
+    uint32_t closed;                 //set by the producer after its last frame
+    _Alignas(SHM_RING_ALIGN) uint32_t published;  //frames published, the futex word the consumer waits on
+    _Alignas(SHM_RING_ALIGN) uint32_t released;   //frames released, the futex word the producer waits on
+};
+
+/* The start of every slot; the pixels follow at SHM_RING_ALIGN bytes. */
+struct shm_ring_slot {
+    uint64_t sequence;               //1-based frame number
+    uint64_t timestamp;              //CLOCK_MONOTONIC nanoseconds when the frame entered the first ring
+};
+
+/* A process's handle on a ring. */
+struct shm_ring {
+    struct shm_ring_header *header;
+    unsigned char *slots;
+    size_t mapped_size;
+    uint32_t position;               //frames this side has acquired (producer) or taken (consumer)
+    int owner;                       //created here, unlinked by shm_ring_detach
+    char name[256];
+};
+
+uint64_t shm_ring_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* Wait until *word may have changed from seen, or for at most SHM_RING_WAIT_NS. */
+void shm_ring_wait(uint32_t *word, uint32_t seen)
+{
+    struct timespec timeout = { 0, SHM_RING_WAIT_NS };
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+#else
+    (void)word;
+    (void)seen;
+    timeout.tv_nsec = 50000;
+    nanosleep(&timeout, NULL);
+#endif
+}
+
+void shm_ring_wake(uint32_t *word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+size_t shm_ring_mapped_size(uint32_t slot_count, uint64_t slot_size)
+{
+    return sizeof(struct shm_ring_header) + (size_t)slot_count * slot_size;
+}
+
+/* Create the ring name (e.g. "/edges") for slot_count frames of width x height RGB pixels, replacing a stale one.
+ slot_count must be a power of two.
+ Return: 0 on success, -1 otherwise.
+ */
+int shm_ring_create(struct shm_ring *ring, const char *name, uint32_t slot_count, uint32_t width, uint32_t height)
+{
+    uint64_t frame_size = (uint64_t)width * height * 3;
+    uint64_t slot_size = (SHM_RING_ALIGN + frame_size + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN;
+    size_t size = shm_ring_mapped_size(slot_count, slot_size);
+
+    memset(ring, 0, sizeof(*ring));
+    if(slot_count == 0 || (slot_count & (slot_count - 1)) != 0)
+    {
+        fprintf(stderr, "The shared memory ring '%s' needs a power of two slots, not %u\n", name, slot_count);
+        return -1;
+    }
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0 || ftruncate(fd, size) != 0)
+    {
+        fprintf(stderr, "Unable to create the shared memory ring '%s'\n", name);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map the shared memory ring '%s'\n", name);
+        shm_unlink(name);
+        return -1;
+    }
+
+    ring->header = (struct shm_ring_header *)base;
+    ring->slots = (unsigned char *)base + sizeof(struct shm_ring_header);
+    ring->mapped_size = size;
+    ring->owner = 1;
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    ring->header->slot_count = slot_count;
+    ring->header->width = width;
+    ring->header->height = height;
+    ring->header->frame_size = frame_size;
+    ring->header->slot_size = slot_size;
+    __atomic_store_n(&ring->header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Map the ring name created by another process, waiting up to timeout_ms for it to appear.
+ Return: 0 on success, -1 otherwise.
+ */
+int shm_ring_attach(struct shm_ring *ring, const char *name, int timeout_ms)
+{
+    uint64_t deadline = shm_ring_now() + (uint64_t)timeout_ms * 1000000u;
+    struct timespec pause = { 0, 10000000 };
+    memset(ring, 0, sizeof(*ring));
+    for(;;)
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        struct stat st;
+        if(fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct shm_ring_header))
+        {
+            void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(base != MAP_FAILED)
+            {
+                struct shm_ring_header *header = (struct shm_ring_header *)base;
+                if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_RING_MAGIC
+                   && header->slot_count != 0 && (header->slot_count & (header->slot_count - 1)) == 0
+                   && shm_ring_mapped_size(header->slot_count, header->slot_size) <= (size_t)st.st_size)
+                {
+                    ring->header = header;
+                    ring->slots = (unsigned char *)base + sizeof(struct shm_ring_header);
+                    ring->mapped_size = st.st_size;
+                    ring->position = __atomic_load_n(&header->released, __ATOMIC_ACQUIRE);
+                    snprintf(ring->name, sizeof(ring->name), "%s", name);
+                    return 0;
+                }
+                munmap(base, st.st_size);
+            }
+        }
+        else if(fd >= 0)
+        {
+            close(fd);
+        }
+        if(shm_ring_now() > deadline)
+        {
+            fprintf(stderr, "No shared memory ring '%s'\n", name);
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+void shm_ring_detach(struct shm_ring *ring)
+{
+    if(!ring->header) return;
+    munmap(ring->header, ring->mapped_size);
+    if(ring->owner) shm_unlink(ring->name);
+    ring->header = NULL;
+}
+
+struct shm_ring_slot *shm_ring_slot_at(struct shm_ring *ring, uint32_t frame)
+{
+    return (struct shm_ring_slot *)(ring->slots + (uint64_t)(frame & (ring->header->slot_count - 1)) * ring->header->slot_size);
+}
+
+unsigned char *shm_ring_pixels(struct shm_ring_slot *slot)
+{
+    return (unsigned char *)slot + SHM_RING_ALIGN;
+}
+
+/* Producer: wait for a free slot.
+ Return: the slot to fill before shm_ring_publish
+ */
+struct shm_ring_slot *shm_ring_acquire(struct shm_ring *ring)
+{
+    for(;;)
+    {
+        uint32_t released = __atomic_load_n(&ring->header->released, __ATOMIC_ACQUIRE);
+        if(ring->position - released < ring->header->slot_count) break;
+        shm_ring_wait(&ring->header->released, released);
+    }
+    return shm_ring_slot_at(ring, ring->position);
+}
+
+/* Producer: hand the slot returned by shm_ring_acquire over to the consumer. */
+void shm_ring_publish(struct shm_ring *ring)
+{
+    ring->position++;
+    __atomic_store_n(&ring->header->published, ring->position, __ATOMIC_RELEASE);
+    shm_ring_wake(&ring->header->published);
+}
+
+/* Producer: no more frames. */
+void shm_ring_close(struct shm_ring *ring)
+{
+    __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+    shm_ring_wake(&ring->header->published);
+}
+
+/* Producer: wait until the consumer has released every published frame, or for at most timeout_ms. */
+void shm_ring_drain(struct shm_ring *ring, int timeout_ms)
+{
+    uint64_t deadline = shm_ring_now() + (uint64_t)timeout_ms * 1000000u;
+    uint32_t released;
+    while((released = __atomic_load_n(&ring->header->released, __ATOMIC_ACQUIRE)) != ring->position && shm_ring_now() < deadline)
+    {
+        shm_ring_wait(&ring->header->released, released);
+    }
+}
+
+/* Consumer: wait for the oldest frame not taken yet.
+ Return: its slot, to be given back with shm_ring_release, or NULL once the ring is closed and empty
+ */
+struct shm_ring_slot *shm_ring_next(struct shm_ring *ring)
+{
+    for(;;)
+    {
+        uint32_t published = __atomic_load_n(&ring->header->published, __ATOMIC_ACQUIRE);
+        if(published != ring->position) break;
+        if(__atomic_load_n(&ring->header->closed, __ATOMIC_ACQUIRE))
+        {
+            //Frames published just before closing still count.
+            if(__atomic_load_n(&ring->header->published, __ATOMIC_ACQUIRE) == ring->position) return NULL;
+            continue;
+        }
+        shm_ring_wait(&ring->header->published, published);
+    }
+    return shm_ring_slot_at(ring, ring->position);
+}
+
+/* Consumer: give the slot returned by shm_ring_next back to the producer. */
+void shm_ring_release(struct shm_ring *ring)
+{
+    ring->position++;
+    __atomic_store_n(&ring->header->released, ring->position, __ATOMIC_RELEASE);
+    shm_ring_wake(&ring->header->released);
+}
+
+#endif